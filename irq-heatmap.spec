@@ -33,6 +33,7 @@ rm -rf $RPM_BUILD_ROOT
 %files
 %defattr(-,root,root,-)
 %attr(755, root, root) /opt/irq-heatmap/bin/irq_heatmap
+%attr(644, root, root) /opt/irq-heatmap/include/irq_shm.h
 %attr(755, root, root) /etc/profile.d/irq-heatmap.sh
 
 %doc
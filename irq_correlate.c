@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "irq_numa.h"
+#include "irq_correlate.h"
+
+#define PROC_SOFTIRQ "/proc/softirqs"
+#define PROC_INTERRUPTS "/proc/interrupts"
+
+static int window_length;
+static double alpha;          // weight of the newest interval, 2/(window+1) as for an ema
+static int cpu_count;
+static int updates;
+
+// vector major, [v*cpu_count + c], so the update is a straight run over the cpus of each vector
+static struct corr_vector *vectors;
+static int vector_count, vector_capacity;
+static unsigned long int *current, *previous;
+static double *mean, *variance, *covariance;
+
+// the load, sys+irq+softirq ms per interval
+static double load_mean[MAX_CPUS], load_variance[MAX_CPUS];
+
+void irqcorr_init(int window, int cpus)
+{
+     window_length = window;
+     alpha = 2.0/(window+1);
+     cpu_count = cpus;
+     return;
+}
+
+static void grow_vectors()
+{
+     int capacity = (vector_capacity > 0) ? vector_capacity*2 : 256;
+     size_t old = (size_t)vector_capacity*cpu_count, size = (size_t)capacity*cpu_count;
+
+     if (capacity > MAX_VECTORS) {
+	  fprintf(stderr,"more than %d interrupt and softirq vectors, increase MAX_VECTORS\n",MAX_VECTORS);
+	  exit(-1);
+     }
+     vectors = realloc(vectors,capacity*sizeof(struct corr_vector));
+     current = realloc(current,size*sizeof(unsigned long int));
+     previous = realloc(previous,size*sizeof(unsigned long int));
+     mean = realloc(mean,size*sizeof(double));
+     variance = realloc(variance,size*sizeof(double));
+     covariance = realloc(covariance,size*sizeof(double));
+     if ((vectors == NULL) || (current == NULL) || (previous == NULL) || (mean == NULL) || (variance == NULL) || (covariance == NULL)) {
+	  fprintf(stderr,"unable to allocate correlation buffers for %d vectors\n",capacity);
+	  exit(-1);
+     }
+     memset((void *)&vectors[vector_capacity],0,(capacity-vector_capacity)*sizeof(struct corr_vector));
+     memset((void *)&current[old],0,(size-old)*sizeof(unsigned long int));
+     vector_capacity = capacity;
+     return;
+}
+
+// the row for label. Rows come back in the same order each pass, so *hint is usually it
+static int find_vector(char *label, int *hint)
+{
+     int v = *hint;
+
+     if ((v >= vector_count) || (strcmp(vectors[v].label,label) != 0)) {
+	  for (v=0;v<vector_count;v++) if (strcmp(vectors[v].label,label) == 0) break;
+	  if (v == vector_count) {
+	       if (vector_count == vector_capacity) grow_vectors();
+	       snprintf(vectors[v].label,CORR_LABEL,"%s",label);
+	       vector_count++;
+	  }
+     }
+     *hint = v+1;
+     return v;
+}
+
+// one pass of a table. In /proc/interrupts the numbered rows get the device from the end of the line,
+//   75:   81913889          0   PCI-MSI-edge      eth0        -> 75:eth0
+//  NMI:     137218     111219   Non-maskable interrupts       -> NMI
+// and in /proc/softirqs the row is prefixed, NET_RX -> si:NET_RX, as some names are in both
+static void gather_table(char *table_name, char *prefix, int *hint)
+{
+     FILE *fp;
+     char *line = NULL, *colon, *startptr, *endptr, *name, label[CORR_LABEL];
+     size_t line_size = 0;
+     int c,v;
+
+     if ((fp = fopen(table_name,"r")) == NULL) return;
+     // the first line is the cpu names
+     if (getline(&line,&line_size,fp) < 0) {
+	  fclose(fp);
+	  free(line);
+	  return;
+     }
+     while (getline(&line,&line_size,fp) >= 0) {
+	  if ((colon = strchr(line,':')) == NULL) continue;
+	  *colon = '\0';
+	  name = line;
+	  while (*name == ' ') name++;
+	  startptr = endptr = colon+1;
+	  // a number has to look for the device after the counts. ERR and MIS have one count, not one per cpu
+	  for (c=0;c<cpu_count;c++) {
+	       strtoul(startptr,&endptr,10);
+	       if (endptr == startptr) break;
+	       startptr = endptr;
+	  }
+	  endptr[strcspn(endptr,"\n")] = '\0';
+	  if ((*name >= '0') && (*name <= '9') && (strrchr(endptr,' ') != NULL)) {
+	       snprintf(label,sizeof(label),"%s%s:%s",prefix,name,strrchr(endptr,' ')+1);
+	  } else {
+	       snprintf(label,sizeof(label),"%s%s",prefix,name);
+	  }
+	  v = find_vector(label,hint);
+	  startptr = colon+1;
+	  for (c=0;c<cpu_count;c++) {
+	       current[(size_t)v*cpu_count + c] = strtoul(startptr,&endptr,10);
+	       if (endptr == startptr) break;
+	       startptr = endptr;
+	  }
+     }
+     fclose(fp);
+     free(line);
+     return;
+}
+
+// every row of /proc/interrupts and /proc/softirqs into current
+void irqcorr_gather()
+{
+     int hint = 0;
+
+     gather_table(PROC_INTERRUPTS,"",&hint);
+     gather_table(PROC_SOFTIRQ,"si:",&hint);
+     return;
+}
+
+// fold this interval into the running statistics. load is each cpu's sys+irq+softirq ms this interval,
+// or NULL on the first, which only has counts to take deltas from. The usual exponentially weighted
+// update, with dx and dy taken before the means move:
+//   mean += a*dx     variance = (1-a)*(variance + a*dx*dx)     covariance = (1-a)*(covariance + a*dx*dy)
+void irqcorr_update(unsigned long int *load)
+{
+     static double dy[MAX_CPUS];
+     double a = alpha, b = 1.0 - alpha;
+     int v,c;
+
+     if (load != NULL) {
+	  for (c=0;c<cpu_count;c++) {
+	       if (updates == 0) load_mean[c] = load[c];
+	       dy[c] = load[c] - load_mean[c];
+	  }
+	  for (v=0;v<vector_count;v++) {
+	       unsigned long int *cur = &current[(size_t)v*cpu_count], *prev = &previous[(size_t)v*cpu_count];
+	       double *mx = &mean[(size_t)v*cpu_count], *vx = &variance[(size_t)v*cpu_count], *cxy = &covariance[(size_t)v*cpu_count];
+
+	       if (vectors[v].primed == 1) {
+		    // the first delta starts the mean, so it doesn't have to climb up from 0
+		    for (c=0;c<cpu_count;c++) {
+			 mx[c] = (cur[c] >= prev[c]) ? cur[c] - prev[c] : 0;
+			 vx[c] = 0;
+			 cxy[c] = 0;
+		    }
+		    vectors[v].primed = 2;
+		    continue;
+	       }
+	       if (vectors[v].primed == 0) continue;
+	       for (c=0;c<cpu_count;c++) {
+		    double x = (cur[c] >= prev[c]) ? cur[c] - prev[c] : 0; // a counter that went backwards, hotplug
+		    double dx = x - mx[c];
+
+		    mx[c] += a*dx;
+		    vx[c] = b*(vx[c] + a*dx*dx);
+		    cxy[c] = b*(cxy[c] + a*dx*dy[c]);
+	       }
+	  }
+	  for (c=0;c<cpu_count;c++) {
+	       load_mean[c] += a*dy[c];
+	       load_variance[c] = b*(load_variance[c] + a*dy[c]*dy[c]);
+	  }
+	  updates++;
+     }
+     for (v=0;v<vector_count;v++) if (vectors[v].primed == 0) vectors[v].primed = 1;
+     memcpy(previous,current,(size_t)vector_count*cpu_count*sizeof(unsigned long int));
+     return;
+}
+
+// for each cpu, the CORR_TOP vectors whose deltas follow its load most closely (pearson r, positive only).
+// Vectors averaging under one count an interval on a cpu are left out, a few stray counts can correlate by chance
+void irqcorr_report(FILE *fp, time_t now)
+{
+     static int top_vector[MAX_CPUS][CORR_TOP];
+     static double top_r[MAX_CPUS][CORR_TOP];
+     char timestamp[64];
+     int v,c,k;
+
+     for (c=0;c<cpu_count;c++) {
+	  for (k=0;k<CORR_TOP;k++) {
+	       top_vector[c][k] = -1;
+	       top_r[c][k] = 0;
+	  }
+     }
+     for (v=0;v<vector_count;v++) {
+	  double *mx = &mean[(size_t)v*cpu_count], *vx = &variance[(size_t)v*cpu_count], *cxy = &covariance[(size_t)v*cpu_count];
+
+	  if (vectors[v].primed < 2) continue;
+	  for (c=0;c<cpu_count;c++) {
+	       double r;
+
+	       if ((mx[c] < 1.0) || (vx[c] <= 0) || (load_variance[c] <= 0)) continue;
+	       r = cxy[c]/sqrt(vx[c]*load_variance[c]);
+	       if (r <= top_r[c][CORR_TOP-1]) continue;
+	       for (k=CORR_TOP-1;(k > 0) && (r > top_r[c][k-1]);k--) {
+		    top_r[c][k] = top_r[c][k-1];
+		    top_vector[c][k] = top_vector[c][k-1];
+	       }
+	       top_r[c][k] = r;
+	       top_vector[c][k] = v;
+	  }
+     }
+
+     strftime(timestamp,sizeof(timestamp),"%H:%M:%S",localtime(&now));
+     fprintf(fp,"%s: sys+irq+softirq ms per interval against each vector, over about the last %d intervals\n",timestamp,window_length);
+     fprintf(fp,"%4s %8s  %s\n","cpu","load ms","vectors that follow it, as r (mean count per interval)");
+     for (c=0;c<cpu_count;c++) {
+	  fprintf(fp,"%4d %8.0f ",c,load_mean[c]);
+	  if (top_vector[c][0] < 0) fprintf(fp," -");
+	  for (k=0;(k < CORR_TOP) && (top_vector[c][k] >= 0);k++) {
+	       v = top_vector[c][k];
+	       fprintf(fp," %s %.2f (%.0f)",vectors[v].label,top_r[c][k],mean[(size_t)v*cpu_count + c]);
+	  }
+	  fprintf(fp,"\n");
+     }
+     fprintf(fp,"\n");
+     return;
+}
@@ -0,0 +1,20 @@
+#include <stdio.h>
+
+// -X. Which interrupt or softirq vectors go with the cpu time a cpu spends in sys, irq and softirq.
+// Every row of /proc/interrupts and /proc/softirqs is tracked, and for each vector and cpu the delta
+// series is correlated with that cpu's load. The window is exponential, so the statistics are running
+// means, variances and covariances updated in place each interval - nothing is kept per interval.
+#define MAX_VECTORS 4096
+#define CORR_TOP 3          // vectors reported per cpu
+#define CORR_LABEL 48
+
+struct corr_vector {
+     char label[CORR_LABEL];  // "75:eth0-TxRx-0", "NMI" or "si:NET_RX"
+     int primed;              // seen once, so previous is good
+};
+
+/* irq_correlate.c */
+void irqcorr_init(int window, int cpu_count);
+void irqcorr_gather(void);
+void irqcorr_update(unsigned long int *load);
+void irqcorr_report(FILE *fp, time_t now);
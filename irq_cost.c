@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "irq_cost.h"
+
+#define PROC_SELF_IO "/proc/self/io"
+
+static int enabled;
+static int io_fd = -1;            // held open, so a sample is one pread
+static unsigned long int io_reads; // our own preads of it so far, and the bytes they returned 
+static unsigned long int io_length;
+static struct cost_phase phases[MAX_COST_PHASES];
+static int phase_count;
+static struct timespec started;
+
+void irqcost_enable()
+{
+     enabled = 1;
+     io_fd = open(PROC_SELF_IO,O_RDONLY); // not every kernel has task io accounting 
+     clock_gettime(CLOCK_MONOTONIC,&started);
+     return;
+}
+
+int irqcost_enabled()
+{
+     return enabled;
+}
+
+// phases are registered whether or not -T is given, so callers don't need to check
+int irqcost_phase(char *name)
+{
+     if (phase_count >= MAX_COST_PHASES) return MAX_COST_PHASES-1; // lumped in with the last 
+     snprintf(phases[phase_count].name,COST_NAME,"%s",name);
+     return phase_count++;
+}
+
+static unsigned long int io_field(char *buffer, char *name)
+{
+     char *p = strstr(buffer,name);
+
+     return (p == NULL) ? 0 : strtoul(p+strlen(name),NULL,10);
+}
+
+// the io counters are read with a syscall of their own, which shows up in later samples. Those are
+// taken off, so a phase only counts its own syscalls and bytes and not the ones spent measuring it.
+// Without /proc/self/io, or if the read fails, only the times are taken 
+static void sample(struct cost_sample *s)
+{
+     char buffer[512];
+     long n;
+
+     memset((void *)s,0,sizeof(struct cost_sample));
+     clock_gettime(CLOCK_MONOTONIC,&s->wall);
+     clock_gettime(CLOCK_THREAD_CPUTIME_ID,&s->cpu);
+     if (io_fd < 0) return;
+     if ((n = pread(io_fd,buffer,sizeof(buffer)-1,0)) <= 0) return;
+     buffer[n] = '\0';
+     s->syscalls = io_field(buffer,"syscr: ") + io_field(buffer,"syscw: ") - io_reads;
+     s->read_bytes = io_field(buffer,"rchar: ") - io_length;
+     s->written_bytes = io_field(buffer,"wchar: ");
+     s->io = 1;
+     io_reads++;
+     io_length += n;
+     return;
+}
+
+static double elapsed_ms(struct timespec *from, struct timespec *to)
+{
+     return (to->tv_sec - from->tv_sec)*1000.0 + (to->tv_nsec - from->tv_nsec)/1000000.0;
+}
+
+void irqcost_begin(int phase)
+{
+     if (!enabled) return;
+     sample(&phases[phase].start);
+     return;
+}
+
+void irqcost_end(int phase)
+{
+     struct cost_phase *p = &phases[phase];
+     struct cost_sample end;
+     struct cost_totals *t[2] = { &p->total, &p->recent };
+     int k;
+
+     if (!enabled) return;
+     sample(&end);
+     for (k=0;k<2;k++) {
+	  t[k]->count++;
+	  t[k]->wall_ms += elapsed_ms(&p->start.wall,&end.wall);
+	  t[k]->cpu_ms += elapsed_ms(&p->start.cpu,&end.cpu);
+	  if (!p->start.io || !end.io) continue;
+	  t[k]->syscalls += end.syscalls - p->start.syscalls;
+	  t[k]->read_bytes += end.read_bytes - p->start.read_bytes;
+	  t[k]->written_bytes += end.written_bytes - p->start.written_bytes;
+     }
+     return;
+}
+
+// one line for the intervals since the last one, averaged per interval. An interval is a pass of the
+// last phase registered, the output 
+void irqcost_status(FILE *fp)
+{
+     struct cost_totals sum;
+     unsigned long int intervals;
+     int i;
+
+     if (!enabled || (phase_count == 0)) return;
+     memset((void *)&sum,0,sizeof(sum));
+     intervals = phases[phase_count-1].recent.count;
+     for (i=0;i<phase_count;i++) {
+	  sum.wall_ms += phases[i].recent.wall_ms;
+	  sum.cpu_ms += phases[i].recent.cpu_ms;
+	  sum.syscalls += phases[i].recent.syscalls;
+	  sum.read_bytes += phases[i].recent.read_bytes;
+	  sum.written_bytes += phases[i].recent.written_bytes;
+	  memset((void *)&phases[i].recent,0,sizeof(struct cost_totals));
+     }
+     if (intervals == 0) return;
+     fprintf(fp,"cost per interval, last %lu: %.3f ms wall, %.3f ms cpu",intervals,sum.wall_ms/intervals,sum.cpu_ms/intervals);
+     if (io_fd >= 0) {
+	  fprintf(fp,", %lu syscalls, %lu bytes read, %lu written",sum.syscalls/intervals,sum.read_bytes/intervals,sum.written_bytes/intervals);
+     }
+     fprintf(fp,"\n");
+     return;
+}
+
+// every phase, per call, and getrusage for the whole run including what's outside the phases 
+void irqcost_summary(FILE *fp)
+{
+     struct rusage usage;
+     struct timespec now;
+     int i;
+
+     if (!enabled) return;
+     fprintf(fp,"\nself cost, per call\n%-20s %8s %10s %10s %9s %10s %10s\n","phase","calls","wall ms","cpu ms","syscalls","read B","written B");
+     for (i=0;i<phase_count;i++) {
+	  struct cost_totals *t = &phases[i].total;
+	  double n = t->count;
+
+	  if (t->count == 0) continue; // e.g. -S ALL wasn't asked for 
+	  fprintf(fp,"%-20s %8lu %10.3f %10.3f",phases[i].name,t->count,t->wall_ms/n,t->cpu_ms/n);
+	  if (io_fd >= 0) fprintf(fp," %9.1f %10.0f %10.0f",t->syscalls/n,t->read_bytes/n,t->written_bytes/n);
+	  fprintf(fp,"\n");
+     }
+     if (io_fd < 0) fprintf(fp,"no %s, so no syscall or byte counts\n",PROC_SELF_IO);
+     clock_gettime(CLOCK_MONOTONIC,&now);
+     if (getrusage(RUSAGE_SELF,&usage) == 0) {
+	  fprintf(fp,"whole run: %.1f s, %.3f s user, %.3f s sys, max rss %ld kB\n",elapsed_ms(&started,&now)/1000.0,
+		  usage.ru_utime.tv_sec + usage.ru_utime.tv_usec/1000000.0,usage.ru_stime.tv_sec + usage.ru_stime.tv_usec/1000000.0,usage.ru_maxrss);
+     }
+     return;
+}
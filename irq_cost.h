@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <time.h>
+
+// -T. What the tool costs the host it's watching, phase by phase: wall time (CLOCK_MONOTONIC), our cpu
+// time (CLOCK_THREAD_CPUTIME_ID), and the read and write syscalls and their bytes from /proc/self/io.
+// Reads in a gather phase are /proc, writes in the render phase are the terminal.
+#define MAX_COST_PHASES 32
+#define COST_NAME 32
+
+struct cost_sample {
+     struct timespec wall;
+     struct timespec cpu;
+     unsigned long int syscalls;
+     unsigned long int read_bytes;
+     unsigned long int written_bytes;
+     int io;                      // the io counters were read, the three above are good
+};
+
+struct cost_totals {
+     unsigned long int count;
+     double wall_ms;
+     double cpu_ms;
+     unsigned long int syscalls;
+     unsigned long int read_bytes;
+     unsigned long int written_bytes;
+};
+
+struct cost_phase {
+     char name[COST_NAME];
+     struct cost_sample start;
+     struct cost_totals total;
+     struct cost_totals recent;  // since the last status line
+};
+
+/* irq_cost.c */
+void irqcost_enable(void);
+int irqcost_enabled(void);
+int irqcost_phase(char *name);
+void irqcost_begin(int phase);
+void irqcost_end(int phase);
+void irqcost_status(FILE *fp);
+void irqcost_summary(FILE *fp);
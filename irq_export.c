@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "irq_export.h"
+#include "irq_shm.h"
+
+#define PROM_BACKLOG 8
+#define PROM_SEND_MS 100 // most a scrape can hold up sampling
+
+struct sink_struct {
+     int type;
+     int fd;   // the file for json and csv, the listening socket for prom, the segment for shm
+     struct irq_shm_header *shm;
+     char *path; // of the shm segment, unlinked at exit
+};
+
+static struct sink_struct sinks[MAX_SINKS];
+static int sink_count;
+
+static struct export_series series[MAX_SERIES];
+static int series_count;
+
+// built on the first snapshot, once the labels and cpu count are known. The json key and prom
+// label text for each series are formatted then too, so a snapshot is only numbers and memcpy.
+static int started;
+static char *record;        // json or csv line
+static int record_size;
+static char *prom;          // the latest prometheus page, served as is
+static int prom_size, prom_length;
+static char *json_key[MAX_SERIES];
+static int *socket_of;      // for the json header, so recordings can be merged (irq_merge.c)
+static char *prom_prefix[MAX_SERIES];
+
+// returns the position after the number. No printf, this is the inner loop of every sink
+static char *put_u64(char *p, unsigned long int v)
+{
+     char tmp[20];
+     int n = 0;
+
+     do {
+	  tmp[n++] = '0' + v%10;
+	  v /= 10;
+     } while (v);
+     while (n) *p++ = tmp[--n];
+     return p;
+}
+
+// copy a label for use inside double quotes. json and prom escape '"' and '\' with a '\', 
+// csv doubles the '"' 
+static char *put_escaped(char *p, char *label, int csv)
+{
+     for (;*label;label++) {
+	  if (csv && (*label == '"')) *p++ = '"';
+	  if (!csv && ((*label == '"') || (*label == '\\'))) *p++ = '\\';
+	  *p++ = (*label == '\n') ? ' ' : *label;
+     }
+     return p;
+}
+
+static int write_all(int fd, char *buffer, int length)
+{
+     int rt;
+
+     while (length > 0) {
+	  if ((rt = write(fd,buffer,length)) < 0) {
+	       if (errno == EINTR) continue;
+	       return -1;
+	  }
+	  buffer += rt;
+	  length -= rt;
+     }
+     return 0;
+}
+
+// listen on 127.0.0.1:port, or on a unix socket for "unix:/path"
+static int prom_listen(char *address)
+{
+     int fd, one = 1;
+
+     if (strncmp(address,"unix:",5) == 0) {
+	  struct sockaddr_un sun;
+
+	  memset(&sun,0,sizeof(sun));
+	  sun.sun_family = AF_UNIX;
+	  if (strlen(address+5) >= sizeof(sun.sun_path)) return -1;
+	  strcpy(sun.sun_path,address+5);
+	  unlink(sun.sun_path);
+	  if ((fd = socket(AF_UNIX,SOCK_STREAM,0)) < 0) return -1;
+	  if (bind(fd,(struct sockaddr *)&sun,sizeof(sun)) < 0) {
+	       close(fd);
+	       return -1;
+	  }
+     } else {
+	  struct sockaddr_in sin;
+	  int port = atoi(address);
+
+	  if ((port <= 0) || (port > 65535)) return -1;
+	  memset(&sin,0,sizeof(sin));
+	  sin.sin_family = AF_INET;
+	  sin.sin_port = htons(port);
+	  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // not for the network at large
+	  if ((fd = socket(AF_INET,SOCK_STREAM,0)) < 0) return -1;
+	  setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+	  if (bind(fd,(struct sockaddr *)&sin,sizeof(sin)) < 0) {
+	       close(fd);
+	       return -1;
+	  }
+     }
+     if (listen(fd,PROM_BACKLOG) < 0) {
+	  close(fd);
+	  return -1;
+     }
+     fcntl(fd,F_SETFL,O_NONBLOCK);
+     return fd;
+}
+
+// a new segment each run, as the layout depends on the metrics. It's sized and mapped on the first snapshot
+static int shm_create(struct sink_struct *s, char *name)
+{
+     char path[256];
+
+     snprintf(path,sizeof(path),"%s%s",(name[0] == '/') ? "" : "/",name);
+     if ((s->path = strdup(path)) == NULL) return -1;
+     shm_unlink(path);
+     return shm_open(path,O_RDWR|O_CREAT|O_EXCL,0644);
+}
+
+static int64_t monotonic_ns()
+{
+     struct timespec now;
+
+     clock_gettime(CLOCK_MONOTONIC,&now);
+     return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+// at exit, so a stopped publisher doesn't leave its memory in /dev/shm. Readers still mapping it see the
+// heartbeat go to 0. A segment made since by another writer under the same name is left alone
+static void shm_close()
+{
+     struct stat ours, named;
+     int i, fd;
+
+     for (i=0;i<sink_count;i++) {
+	  if (sinks[i].type != SINK_SHM) continue;
+	  if (sinks[i].shm != NULL) __atomic_store_n(&sinks[i].shm->heartbeat,0,__ATOMIC_RELEASE);
+	  if ((fd = shm_open(sinks[i].path,O_RDONLY,0)) < 0) continue;
+	  if ((fstat(fd,&named) == 0) && (fstat(sinks[i].fd,&ours) == 0) && (named.st_ino == ours.st_ino)) shm_unlink(sinks[i].path);
+	  close(fd);
+     }
+     return;
+}
+
+// lay out the segment as described in irq_shm.h. Exits if it can't, like the other allocations
+static void shm_start(struct sink_struct *s, int cpu_count)
+{
+     struct irq_shm_header *h;
+     struct irq_shm_label *labels;
+     uint64_t label_offset, ring_offset, slot_size, size;
+     int i;
+
+     label_offset = (sizeof(struct irq_shm_header) + 63) & ~63UL;
+     ring_offset = (label_offset + series_count*sizeof(struct irq_shm_label) + 63) & ~63UL;
+     slot_size = (sizeof(struct irq_shm_slot) + sizeof(uint64_t)*series_count*cpu_count + 63) & ~63UL;
+     size = ring_offset + IRQ_SHM_RING*slot_size;
+
+     if ((ftruncate(s->fd,size) < 0) ||
+	 ((h = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,s->fd,0)) == MAP_FAILED)) {
+	  fprintf(stderr,"unable to set up the shared memory segment: %s\n",strerror(errno));
+	  exit(-1);
+     }
+     h->version = IRQ_SHM_VERSION;
+     h->series_count = series_count;
+     h->cpu_count = cpu_count;
+     h->ring_size = IRQ_SHM_RING;
+     h->slot_size = slot_size;
+     h->label_offset = label_offset;
+     h->ring_offset = ring_offset;
+     h->size = size;
+     h->writer_pid = getpid();
+     h->heartbeat = monotonic_ns();
+     labels = irq_shm_labels(h);
+     for (i=0;i<series_count;i++) snprintf(labels[i].text,IRQ_SHM_LABEL,"%s",series[i].label);
+     __atomic_store_n(&h->magic,IRQ_SHM_MAGIC,__ATOMIC_RELEASE);
+     s->shm = h;
+     return;
+}
+
+// the writer side of the slot seqlock in irq_shm.h
+static void shm_publish(struct irq_shm_header *h, time_t now, int interval, int cpu_count)
+{
+     uint64_t number = h->latest + 1;
+     struct irq_shm_slot *slot = irq_shm_slot(h,number);
+     uint64_t *delta = slot->delta;
+     int i,c;
+
+     __atomic_store_n(&slot->sequence,slot->sequence+1,__ATOMIC_RELAXED);
+     __atomic_thread_fence(__ATOMIC_RELEASE);
+     slot->number = number;
+     slot->time = now;
+     for (i=0;i<series_count;i++) {
+	  for (c=0;c<cpu_count;c++) *delta++ = series[i].current[c] - series[i].previous[c];
+     }
+     __atomic_store_n(&slot->sequence,slot->sequence+1,__ATOMIC_RELEASE);
+     h->interval = interval;
+     __atomic_store_n(&h->heartbeat,monotonic_ns(),__ATOMIC_RELAXED);
+     __atomic_store_n(&h->latest,number,__ATOMIC_RELEASE);
+     return;
+}
+
+// json:<file>, csv:<file> ('-' is stdout), prom:<port>, prom:unix:<path> or shm:<name>. Returns -1 if it can't be set up
+int irqexport_add_sink(char *spec)
+{
+     static int shm_registered;
+     struct sink_struct *s;
+     char *path;
+
+     if (sink_count >= MAX_SINKS) return -1;
+     if ((path = strchr(spec,':')) == NULL) return -1;
+     path++;
+     s = &sinks[sink_count];
+
+     if (strncmp(spec,"json:",5) == 0) s->type = SINK_JSON;
+     else if (strncmp(spec,"csv:",4) == 0) s->type = SINK_CSV;
+     else if (strncmp(spec,"prom:",5) == 0) s->type = SINK_PROM;
+     else if (strncmp(spec,"shm:",4) == 0) s->type = SINK_SHM;
+     else return -1;
+
+     if (s->type == SINK_PROM) {
+	  if ((s->fd = prom_listen(path)) < 0) return -1;
+     } else if (s->type == SINK_SHM) {
+	  if ((s->fd = shm_create(s,path)) < 0) return -1;
+	  if (!shm_registered) atexit(shm_close);
+	  shm_registered = 1;
+     } else if (strcmp(path,"-") == 0) {
+	  s->fd = STDOUT_FILENO;
+     } else if ((s->fd = open(path,O_WRONLY|O_CREAT|O_APPEND,0644)) < 0) {
+	  return -1;
+     }
+     sink_count++;
+     return 0;
+}
+
+int irqexport_enabled()
+{
+     return sink_count > 0;
+}
+
+void irqexport_add_series(char *label, unsigned long int *current, unsigned long int *previous)
+{
+     if (series_count >= MAX_SERIES) return;
+     series[series_count].label = label;
+     series[series_count].current = current;
+     series[series_count].previous = previous;
+     series_count++;
+     return;
+}
+
+// the socket of each cpu, written in the json header line
+void irqexport_set_sockets(int *sockets)
+{
+     socket_of = sockets;
+     return;
+}
+
+// size the buffers, format the per series text and write the csv and json headers. The json header
+// says where the recording came from: {"host":"name","interval":1,"cpus":4,"socket":[0,0,1,1]}
+static void export_start(int cpu_count, int interval)
+{
+     int i,k;
+     char *p, host[256];
+
+     // 20 digits and a separator per value, labels at most twice their length once escaped
+     record_size = 1024 + cpu_count*24; // at least the json header
+     prom_size = 256;
+     for (i=0;i<series_count;i++) {
+	  int label_size = 2*strlen(series[i].label) + 16;
+
+	  record_size += label_size + cpu_count*(label_size + 32);
+	  prom_size += cpu_count*(label_size + 64);
+
+	  json_key[i] = p = malloc(label_size);
+	  *p++ = '"';
+	  p = put_escaped(p,series[i].label,0);
+	  strcpy(p,"\":[");
+
+	  prom_prefix[i] = p = malloc(label_size + 32);
+	  p = p + sprintf(p,"irq_heatmap_delta{metric=\"");
+	  p = put_escaped(p,series[i].label,0);
+	  strcpy(p,"\",cpu=\"");
+     }
+     record = malloc(record_size);
+     prom = malloc(prom_size);
+     if ((record == NULL) || (prom == NULL)) {
+	  fprintf(stderr,"unable to allocate export buffers\n");
+	  exit(-1);
+     }
+
+     // csv is one row per interval, a column per series and cpu
+     p = record;
+     p += sprintf(p,"time,interval");
+     for (i=0;i<series_count;i++) {
+	  for (k=0;k<cpu_count;k++) {
+	       p += sprintf(p,",\"");
+	       p = put_escaped(p,series[i].label,1);
+	       p += sprintf(p,":%d\"",k);
+	  }
+     }
+     *p++ = '\n';
+     for (i=0;i<sink_count;i++) if (sinks[i].type == SINK_CSV) write_all(sinks[i].fd,record,p-record);
+
+     if (gethostname(host,sizeof(host)) < 0) strcpy(host,"unknown");
+     host[sizeof(host)-1] = '\0';
+     p = record;
+     p += sprintf(p,"{\"host\":\"");
+     p = put_escaped(p,host,0);
+     p += sprintf(p,"\",\"interval\":%d,\"cpus\":%d,\"socket\":[",interval,cpu_count);
+     for (k=0;k<cpu_count;k++) {
+	  if (k) *p++ = ',';
+	  p = put_u64(p,socket_of ? socket_of[k] : 0);
+     }
+     p += sprintf(p,"]}\n");
+     for (i=0;i<sink_count;i++) if (sinks[i].type == SINK_JSON) write_all(sinks[i].fd,record,p-record);
+     for (i=0;i<sink_count;i++) if (sinks[i].type == SINK_SHM) shm_start(&sinks[i],cpu_count);
+
+     started = 1;
+     return;
+}
+
+static int format_json(time_t now, int interval, int cpu_count)
+{
+     char *p = record;
+     int i,c;
+
+     p += sprintf(p,"{\"time\":%ld,\"interval\":%d,\"metrics\":{",(long)now,interval);
+     for (i=0;i<series_count;i++) {
+	  int length = strlen(json_key[i]);
+
+	  if (i) *p++ = ',';
+	  memcpy(p,json_key[i],length);
+	  p += length;
+	  for (c=0;c<cpu_count;c++) {
+	       if (c) *p++ = ',';
+	       p = put_u64(p,series[i].current[c] - series[i].previous[c]);
+	  }
+	  *p++ = ']';
+     }
+     p += sprintf(p,"}}\n");
+     return p-record;
+}
+
+static int format_csv(time_t now, int interval, int cpu_count)
+{
+     char *p = record;
+     int i,c;
+
+     p += sprintf(p,"%ld,%d",(long)now,interval);
+     for (i=0;i<series_count;i++) {
+	  for (c=0;c<cpu_count;c++) {
+	       *p++ = ',';
+	       p = put_u64(p,series[i].current[c] - series[i].previous[c]);
+	  }
+     }
+     *p++ = '\n';
+     return p-record;
+}
+
+static int format_prom(time_t now, int interval, int cpu_count)
+{
+     char *p = prom;
+     int i,c;
+
+     p += sprintf(p,"# HELP irq_heatmap_interval_seconds Length of the interval the deltas cover\n");
+     p += sprintf(p,"# TYPE irq_heatmap_interval_seconds gauge\nirq_heatmap_interval_seconds %d\n",interval);
+     p += sprintf(p,"# HELP irq_heatmap_delta Change in the counter per cpu over the last interval\n");
+     p += sprintf(p,"# TYPE irq_heatmap_delta gauge\n");
+     for (i=0;i<series_count;i++) {
+	  int length = strlen(prom_prefix[i]);
+
+	  for (c=0;c<cpu_count;c++) {
+	       memcpy(p,prom_prefix[i],length);
+	       p += length;
+	       p = put_u64(p,c);
+	       *p++ = '"';
+	       *p++ = '}';
+	       *p++ = ' ';
+	       p = put_u64(p,series[i].current[c] - series[i].previous[c]);
+	       *p++ = '\n';
+	  }
+     }
+     return p-prom;
+}
+
+// write this interval to every sink. Called before the current values become the previous ones. 
+// Each format is done once, however many sinks want it. 
+void irqexport_snapshot(time_t now, int interval, int cpu_count)
+{
+     int i, type, length, wanted[SINK_TYPES];
+
+     if (sink_count == 0) return;
+     if (!started) export_start(cpu_count,interval);
+
+     memset(wanted,0,sizeof(wanted));
+     for (i=0;i<sink_count;i++) wanted[sinks[i].type] = 1;
+
+     for (type=SINK_JSON;type<=SINK_CSV;type++) {
+	  if (!wanted[type]) continue;
+	  length = (type == SINK_JSON) ? format_json(now,interval,cpu_count) : format_csv(now,interval,cpu_count);
+	  for (i=0;i<sink_count;i++) if (sinks[i].type == type) write_all(sinks[i].fd,record,length);
+     }
+     if (wanted[SINK_PROM]) prom_length = format_prom(now,interval,cpu_count);
+     for (i=0;i<sink_count;i++) if (sinks[i].type == SINK_SHM) shm_publish(sinks[i].shm,now,interval,cpu_count);
+     return;
+}
+
+// a scrape is served from inside the sampling loop, so nothing here may block for long: the socket is
+// non-blocking, the request isn't waited for, and the page gets PROM_SEND_MS to go out. MSG_NOSIGNAL,
+// as a scraper that hangs up early mustn't take the tool down with SIGPIPE
+static int remaining_ms(struct timespec *deadline)
+{
+     struct timespec now;
+
+     clock_gettime(CLOCK_MONOTONIC,&now);
+     return (deadline->tv_sec - now.tv_sec)*1000 + (deadline->tv_nsec - now.tv_nsec)/1000000;
+}
+
+static int send_all(int fd, char *buffer, int length, int flags, struct timespec *deadline)
+{
+     struct pollfd out = { fd, POLLOUT, 0 };
+     int rt;
+
+     while (length > 0) {
+	  if ((rt = send(fd,buffer,length,flags|MSG_NOSIGNAL)) >= 0) {
+	       buffer += rt;
+	       length -= rt;
+	       continue;
+	  }
+	  if (errno == EINTR) continue;
+	  if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) return -1;
+	  if (((rt = remaining_ms(deadline)) <= 0) || (poll(&out,1,rt) <= 0)) return -1;
+     }
+     return 0;
+}
+
+static void prom_serve(int listen_fd)
+{
+     char request[1024], response[256];
+     struct timespec deadline;
+     int fd, length;
+
+     if ((fd = accept(listen_fd,NULL,NULL)) < 0) return;
+     fcntl(fd,F_SETFL,O_NONBLOCK);
+     // whatever of the request has arrived. There's only one page, so it doesn't matter what it says 
+     if (read(fd,request,sizeof(request)) == 0) {
+	  close(fd);
+	  return;
+     }
+     clock_gettime(CLOCK_MONOTONIC,&deadline);
+     deadline.tv_nsec += PROM_SEND_MS*1000000L;
+     if (deadline.tv_nsec >= 1000000000L) {
+	  deadline.tv_sec++;
+	  deadline.tv_nsec -= 1000000000L;
+     }
+     length = snprintf(response,sizeof(response),
+		       "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+		       prom_length);
+     if (send_all(fd,response,length,MSG_MORE,&deadline) == 0) send_all(fd,prom,prom_length,0,&deadline);
+     // closing with some of the request still unread sends a reset, which can overtake the page. So say
+     // we're done, and read until the client closes too or the deadline, whichever is first 
+     shutdown(fd,SHUT_WR);
+     for (;;) {
+	  struct pollfd in = { fd, POLLIN, 0 };
+	  int rt = remaining_ms(&deadline);
+
+	  if ((rt <= 0) || (poll(&in,1,rt) <= 0)) break;
+	  if ((rt = read(fd,request,sizeof(request))) == 0) break;
+	  if ((rt < 0) && (errno != EINTR) && (errno != EAGAIN)) break;
+     }
+     close(fd);
+     return;
+}
+
+// sleep until the next interval, answering prometheus scrapes while we wait
+void irqexport_wait(int seconds)
+{
+     struct pollfd fds[MAX_SINKS];
+     struct timespec now, end;
+     int i, n = 0;
+
+     for (i=0;i<sink_count;i++) {
+	  if (sinks[i].type != SINK_PROM) continue;
+	  fds[n].fd = sinks[i].fd;
+	  fds[n].events = POLLIN;
+	  n++;
+     }
+     if (n == 0) {
+	  sleep(seconds);
+	  return;
+     }
+
+     clock_gettime(CLOCK_MONOTONIC,&end);
+     end.tv_sec += seconds;
+     for (;;) {
+	  long remaining;
+
+	  clock_gettime(CLOCK_MONOTONIC,&now);
+	  remaining = (end.tv_sec - now.tv_sec)*1000 + (end.tv_nsec - now.tv_nsec)/1000000;
+	  if (remaining <= 0) break;
+	  if (poll(fds,n,remaining) <= 0) continue;
+	  for (i=0;i<n;i++) if (fds[i].revents & POLLIN) prom_serve(fds[i].fd);
+     }
+     return;
+}
@@ -0,0 +1,27 @@
+#include <time.h>
+
+// machine readable output. Each series is a per cpu counter, previous and current, owned by the
+// caller - a metric or a row of the softirq matrix. Every sink works from the deltas of those
+// same arrays, so nothing is parsed twice, and formats into buffers allocated on the first snapshot.
+#define MAX_SERIES 64
+#define MAX_SINKS 8
+
+#define SINK_JSON 0
+#define SINK_CSV  1
+#define SINK_PROM 2
+#define SINK_SHM  3 // layout in irq_shm.h
+#define SINK_TYPES 4
+
+struct export_series {
+     char *label;
+     unsigned long int *current;
+     unsigned long int *previous;
+};
+
+/* irq_export.c */
+int irqexport_add_sink(char *spec);
+int irqexport_enabled(void);
+void irqexport_set_sockets(int *sockets);
+void irqexport_add_series(char *label, unsigned long int *current, unsigned long int *previous);
+void irqexport_snapshot(time_t now, int interval, int cpu_count);
+void irqexport_wait(int seconds);
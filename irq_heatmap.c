@@ -5,7 +5,16 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <poll.h>
 #include "irq_numa.h"
+#include "irq_scale.h"
+#include "irq_export.h"
+#include "irq_merge.h"
+#include "irq_correlate.h"
+#include "irq_cost.h"
+#include "irq_history.h"
 
 /* globals */
 
@@ -34,7 +43,6 @@ char **colors;
 
 #define MAX_METRICS 16
 #define MAX_LABEL   64
-#define MAX_CPUS (MAX_SOCKETS*MAX_THREADS*MAX_CORES)  
 
 #define TYPE_CPU 0
 #define TYPE_IRQ 1
@@ -50,11 +58,13 @@ struct line_struct {
 #define LINE_METRIC 0
 #define LINE_SOCKET 1
 #define LINE_THREAD 2
-#define LINE_CPUID1 3
-#define LINE_CPUID2 4
-#define LINE_COUNT  5
+#define LINE_CPUID1 3 // the cpu id, a digit per line, most significant first 
+#define LINE_CPUID_DIGITS 4 // enough for MAX_CPUS 
+#define LINE_COUNT  (LINE_CPUID1+LINE_CPUID_DIGITS)
 
 struct header_struct {
+     int matrix_offset; // column where the softirq matrix starts 
+     int cpuid_digits;  // lines of cpu id in use, at least 2 
      struct line_struct line[LINE_COUNT];
 } header;
 
@@ -63,12 +73,39 @@ struct metrics_struct {
      char label[MAX_LABEL];
      int label_length;
      int index;   // used for cpu. which column in /proc/stat  
+     struct scale_struct scale;
      unsigned long int previous[MAX_CPUS];
      unsigned long int current[MAX_CPUS];
 } metrics [MAX_METRICS];
 
 int metric_count;
 
+// -F and -A. fold_mode -1 picks the finest fold that fits the terminal 
+int fold_mode = -1;
+int fold_sum = 0;
+char *fold_names[] = { "none", "core", "l3", "node" };
+char *fold_labels[] = { "Thread", "Core", "L3", "Node" };
+struct fold_layout fold;
+
+// -Q. Metrics take a copy of default_scale when they're created, and -Q changes the scale of the 
+// last metric given, or the default if there isn't one yet 
+struct scale_struct default_scale;
+struct scale_struct *last_scale = &default_scale;
+
+// -S ALL. Every softirq vector, read in one pass of /proc/softirqs. Doesn't use a metrics slot.
+// The row names come from the file, as they vary between kernels (BLOCK_IOPOLL became IRQ_POLL) 
+#define SOFTIRQ_GUTTER 11
+
+struct softirq_matrix_struct {
+     int enabled;
+     int vector_count;
+     char label[N_SOFTIRQ_VECTORS][MAX_LABEL];
+     char export_label[N_SOFTIRQ_VECTORS][MAX_LABEL+8]; // "softirq NET_RX", so -S NET_RX -S ALL don't clash 
+     struct scale_struct scale;
+     unsigned long int previous[N_SOFTIRQ_VECTORS][MAX_CPUS];
+     unsigned long int current[N_SOFTIRQ_VECTORS][MAX_CPUS];
+} softirq_matrix;
+
 // 
 void dump_state()
 {
@@ -109,14 +146,39 @@ void usage(char *argv[])
      printf("usage: -C <label> Show cpu time for user,nice,sys,idle,wio,irq,softirq. See note below.\n");
      printf("                  the label 'all' will show the sum of user,nice,sys,wio,irq,softirq\n");
      printf("usage: -S <label> Show the SOFTIRQ vector corresponding with that label, e.g. SCHED, NET_RX\n");
+     printf("                  the label 'ALL' shows every vector as stacked rows, plus a 'top' row with the busiest vector per cpu\n");
      printf("usage: -I <label> Show the IRQ activity for that vector from /proc/interrupts e.g. 75, NMI\n");
      printf("usage: -M <string> Sum the IRQ activity across all vectors that match this terminal string e.g. p5p1-TxRx\n");
      printf("usage: -P <string> Show the activity in the softnet_stats by column: packets, dropped, squeeze\n\n");
+     printf("usage: -o <string> Also write each interval's raw per cpu deltas to json:<file>, csv:<file> ('-' for stdout),\n");
+     printf("                  or serve them for prometheus on prom:<port> (localhost only) or prom:unix:<path>,\n");
+     printf("                  or publish them in shared memory with shm:<name>, see irq_shm.h. May be repeated\n");
+     printf("usage: -q Don't show the heatmap, only the -o outputs\n");
+     printf("usage: -D As -q, but run in the background. e.g. -D -S NET_RX -o shm:irq_heatmap publishes to /dev/shm/irq_heatmap\n");
+     printf("usage: -m <file> Merge json recordings (-o json:<file>) from several hosts into one view, a line per host.\n");
+     printf("                  <file>@<seconds> adds an offset to that host's clock. Repeat for each host. -i sets the interval\n");
+     printf("                  Clock skew between the hosts isn't detected, measure it and give it as the offset\n");
+     printf("                  The metric options pick which recorded metrics to show, by name. Without any, all of them\n");
+     printf("usage: -X <number> Instead of the heatmap, correlate every /proc/interrupts and /proc/softirqs vector with each\n");
+     printf("                  cpu's sys+irq+softirq time over about the last <number> intervals, and report the vectors\n");
+     printf("                  that follow it most closely per cpu, once every <number> intervals\n");
+     printf("usage: -T Measure what the tool itself costs: wall and cpu time, syscalls, bytes read and written, for each\n");
+     printf("                  phase. A status line every 60 intervals and a summary on exit, both on stderr\n");
+     printf("usage: -H <bytes> Keep the history of every metric in memory, compressed, up to <bytes> (K, M or G) e.g. 256M.\n");
+     printf("                  Type '<intervals back> [fold] [scale]' and return, e.g. '600 l3 lin', to see a screenful from then\n");
+     printf("usage: -c Keep the topology in %s between runs, keyed by boot id and online cpus. Speeds up short -t runs\n",TOPOLOGY_CACHE_PATH);
+     printf("usage: -F <string> Fold cpus into fewer columns: none, core (hyperthread siblings), l3 (shared L3/CCX), node (numa node)\n");
+     printf("                  or auto, the default, which picks the finest that fits the terminal\n");
+     printf("usage: -A <string> How folded cpus are combined: max (default) or sum\n");
+     printf("usage: -Q <string> Scale for the metric before it (or every later one if it comes first): log, lin or pct, with an\n");
+     printf("                  optional :floor:ceiling, e.g. -I 75 -Q log:1000 or -Q lin:0:1000. pct adapts to the values it has seen\n");
+     printf("usage: -R <number> Color levels: 16 (default, one per power of 2), 32 or 64 (2 or 4 steps per power of 2)\n");
      printf("usage: -Z <string> Choose a color scale: bgy (blue green yellow, default), red (red temperature scale for loren acton), rbw (rainbow, long to short wavelengths)\n\n");
-     printf("Version %f, Limits: max_metrics=%d, max_cpus=%d, clock tick ms=%d\n\n",VERSION, MAX_METRICS, MAX_CPUS,topology.clock_tick_ms);
+     printf("Version %f, Limits: max_metrics=%d, max_cpus=%d, clock tick ms=%d\n\n",VERSION, MAX_METRICS, MAX_CPUS,irqnuma_get_clocktick_ms());
      printf("CPU time. This is taken from the jiffies from /proc/stat. Its then scaled up to milliseconds using _SC_CLK_TCK.\n");
      printf("\tThis means that 100%% cpu is 1000ms per second. This displays as the number 'a'\n");
-     printf("Scale is log2. So '9' is a delta of 2^9 (or 1<<9) per interval\n\n");
+     printf("Scale is log2 by default. So '9' is a delta of 2^9 (or 1<<9) per interval. With -R 32 or 64 the levels\n");
+     printf("\tgo 0-9, a-z, A-Z and each power of 2 is 2 or 4 levels.\n\n");
      printf("Colours and scales\n");
      printf("\tbgy\tred\trbw\tmono\tscale\n");
      for (i=0;i<max_colors;i++) {
@@ -132,18 +194,6 @@ void error()
      exit(1);
 }
 
-// this is how we convert the delta to a displayed value. In this case we're taking the power of 2 via bitshift
-// it would be possible to have other scale factors. 
-unsigned int shift_log2(unsigned long int delta)
-{
-     int i=0;
-     while (delta >= 1) {
-	  delta = delta >> 1;
-	  i++;
-     }
-     return i;
-}
-
 int get_procstat_column(char *name, char *argv[])
 {
      int len = strlen(name);
@@ -182,16 +232,17 @@ void gather_softnet_metrics(struct metrics_struct *m)
      char line[1024], *endptr;
      int cpu_count = topology.number_of_cpus;
      int c;
-     unsigned long int datum;
+     unsigned long int datum=0;
 
      if ((fp = fopen(PROC_SOFTNET_STATS,"r")) == NULL) return;
+     line[0]=' '; // first column has no space, so we read in after one 
      
      // line format is one line per cpu. Similar to cpu stats
      // Columns. Total packets processed, packets dropped, timesqueezed, cpu_collision, recv_rps, flow_limit
      //          We look for 'packets', 'dropped', 'squeeze'
      for (c=0;c<cpu_count;c++) {
-	  if (fgets(line,1024,fp) == NULL) return;
-	  endptr=line-1; // first column has no space. 
+	  if (fgets(line+1,1023,fp) == NULL) return;
+	  endptr=line;
 	  switch(m->index) {
 	  case 5: // column 6 - flow_limit
 	       datum  = strtoul(endptr+1,&endptr,16);	       
@@ -219,7 +270,7 @@ void gather_cpu_metrics(struct metrics_struct *m)
      char line[1024], *endptr;
      int cpu_count = topology.number_of_cpus;
      int c;
-     unsigned long int cpuid,datum;
+     unsigned long int cpuid,datum=0;
      
      if ((fp = fopen(PROC_CPU,"r")) == NULL) return;
 
@@ -369,100 +420,571 @@ void gather_softirq_metrics(struct metrics_struct *m)
      return gather_tagged_table_metrics(m,PROC_SOFTIRQ);
 }
 
+// put a single character into a header line at offset, padding with spaces up to it 
+void header_putc(int line, int offset, char ch)
+{
+     struct line_struct *l = &header.line[line];
+     
+     if (offset >= sizeof(l->buffer)-1) return;
+     while (l->cursor < offset) l->buffer[l->cursor++]=' ';
+     l->buffer[offset]=ch;
+     if (l->cursor <= offset) l->cursor = offset+1;
+     return;
+}
+
+// a string at offset, or after whatever is already on the line if that runs past it. Cut off at the end of the buffer 
+void header_puts(int line, int offset, char *text)
+{
+     if (header.line[line].cursor > offset) offset = header.line[line].cursor;
+     for (;*text;text++) header_putc(line,offset++,*text);
+     return;
+}
+
+// lay out the socket/thread/cpu columns for one group of cells, starting at offset. 
+// returns the offset just past the group. When folded the thread line shows how many cpus 
+// went into each column and the cpu lines the lowest cpu id in it. 
+int header_add_cpus(int offset)
+{
+     int k,d,leader;
+     
+     for (k=0;k<fold.column_count;k++) {
+	  struct fold_column *col = &fold.columns[k];
+	  
+	  if (col->separator) offset++; // ' ' or '|' 
+	  if ((k == 0) || (col->socket != fold.columns[k-1].socket)) header_putc(LINE_SOCKET,offset,'0'+col->socket);
+	  if (fold.mode == FOLD_NONE) {
+	       if ((k == 0) || (col->separator)) header_putc(LINE_THREAD,offset,'0'+col->thread);
+	  } else {
+	       header_putc(LINE_THREAD,offset,(col->cpu_count < 16) ? scale_glyphs[col->cpu_count] : '+');
+	  }
+	  for (d=header.cpuid_digits-1,leader=col->leader;d>=0;d--,leader/=10) header_putc(LINE_CPUID1+d,offset,'0'+(leader%10));
+	  offset++;
+     }
+     return offset;
+}
+
+// the width of a line of output for a layout, so we can tell if it fits 
+int layout_width(struct fold_layout *f)
+{
+     int width = 10 + metric_count*(f->width+2);
+     
+     if (softirq_matrix.enabled) width += SOFTIRQ_GUTTER + f->width;
+     return width;
+}
+
+// columns of the terminal on stdout. 0 if it isn't one, which means no limit 
+int terminal_width()
+{
+     struct winsize ws;
+     char *columns;
+     
+     if ((ioctl(STDOUT_FILENO,TIOCGWINSZ,&ws) == 0) && (ws.ws_col > 0)) return ws.ws_col;
+     if ((columns = getenv("COLUMNS")) != NULL) return atoi(columns);
+     return 0;
+}
+
+// -S ALL. As gather_softirq_metrics, but takes every vector from one read of the file. 
+// Lines are in the kernel's enum order: HI, TIMER, NET_TX, NET_RX, BLOCK, IRQ_POLL, TASKLET, SCHED, HRTIMER, RCU 
+void gather_softirq_matrix()
+{
+     FILE *fp;
+     char line[MAX_CPUS*12], *endptr, *startptr, *cp; // 1024 cpus of 10 digits and padding 
+     int cpu_count = topology.number_of_cpus;
+     int c,k,v=0;
+     
+     if ((fp = fopen(PROC_SOFTIRQ,"r")) == NULL) return;
+     // skip the CPU0 CPU1 .. title line 
+     if (fgets(line,sizeof(line),fp) == NULL) {
+	  fclose(fp);
+	  return;
+     }
+     while ((v < N_SOFTIRQ_VECTORS) && (fgets(line,sizeof(line),fp) != NULL)) {
+	  if ((cp = strchr(line,':')) == NULL) continue;
+	  *cp = '\0';
+	  k=0;
+	  while (line[k]==' ') k++;
+	  if (softirq_matrix.label[v][0] == '\0') {
+	       snprintf(softirq_matrix.label[v],MAX_LABEL,"%.*s",MAX_LABEL-1,&line[k]);
+	       snprintf(softirq_matrix.export_label[v],sizeof(softirq_matrix.export_label[v]),"softirq %s",softirq_matrix.label[v]);
+	  }
+	  startptr = cp+1;
+	  for (c=0;c<cpu_count;c++) {
+	       softirq_matrix.current[v][c] = strtoul(startptr,&endptr,10);
+	       startptr = endptr;
+	  }
+	  v++;
+     }
+     fclose(fp);
+     softirq_matrix.vector_count = v;
+     return;
+}
+
 // there's a lot to show here and an uncertain amount of space to show it in. 
 void init_header()
 {
-     int i,m,s,t,c,offset;
+     int i,m,offset,mode,width;
+     int leader_limit[LINE_CPUID_DIGITS] = { 1, 10, 100, 1000 };
+
+     // -F picks the fold, otherwise take the finest one that fits the terminal 
+     if (fold_mode >= 0) {
+	  irqnuma_build_fold(fold_mode,&fold);
+     } else {
+	  width = terminal_width();
+	  for (mode=FOLD_NONE;mode<FOLD_COUNT;mode++) {
+	       irqnuma_build_fold(mode,&fold);
+	       if ((width == 0) || (layout_width(&fold) <= width)) break;
+	  }
+     }
 
      memset((void *)&header,0,sizeof(header));
 
      sprintf(header.line[LINE_METRIC].buffer,"%-10s","Metric");
      sprintf(header.line[LINE_SOCKET].buffer,"%-10s","Socket");
-     sprintf(header.line[LINE_THREAD].buffer,"%-10s","Thread");
+     sprintf(header.line[LINE_THREAD].buffer,"%-10s",fold_labels[fold.mode]);
      sprintf(header.line[LINE_CPUID1].buffer,"%-10s","Cpu");
-     sprintf(header.line[LINE_CPUID2].buffer,"%-10s","   ");
+     for (i=1;i<LINE_CPUID_DIGITS;i++) sprintf(header.line[LINE_CPUID1+i].buffer,"%-10s","   ");
+     header.cpuid_digits = 2;
+     for (i=0;i<fold.column_count;i++) {
+	  while ((header.cpuid_digits < LINE_CPUID_DIGITS) && (fold.columns[i].leader >= leader_limit[header.cpuid_digits])) header.cpuid_digits++;
+     }
      
      offset=10; // offset from start. 
      for (i=0;i<LINE_COUNT;i++) header.line[i].cursor = 10;
      
      for (m=0;m<metric_count;m++) {
-	  while (header.line[LINE_METRIC].cursor < offset) header.line[LINE_METRIC].buffer[header.line[LINE_METRIC].cursor++]=' ';
-	  sprintf(&header.line[LINE_METRIC].buffer[header.line[LINE_METRIC].cursor],"%s",metrics[m].label);
-	  header.line[LINE_METRIC].cursor+=metrics[m].label_length;
+	  header_puts(LINE_METRIC,offset,metrics[m].label);
 	  
-	  for (s=0;s<topology.number_of_sockets;s++) {
-	       while (header.line[LINE_SOCKET].cursor < offset) header.line[LINE_SOCKET].buffer[header.line[LINE_SOCKET].cursor++]=' ';
-	       sprintf(&header.line[LINE_SOCKET].buffer[header.line[LINE_SOCKET].cursor],"%1.1d",s);
-	       header.line[LINE_SOCKET].cursor++;
-	       
-	       for (t=0;t<topology.map[s].thread_count;t++) {
-		    while (header.line[LINE_THREAD].cursor < offset) header.line[LINE_THREAD].buffer[header.line[LINE_THREAD].cursor++]=' ';
-		    sprintf(&header.line[LINE_THREAD].buffer[header.line[LINE_THREAD].cursor],"%1.1d",t);
-		    header.line[LINE_THREAD].cursor++;
-		    
-		    for (c=0;c<topology.map[s].threads[t].core_count;c++){
-			 int cpuid = topology.map[s].threads[t].cores[c].cpu_id;
-			 
-			 while (header.line[LINE_CPUID1].cursor < offset) header.line[LINE_CPUID1].buffer[header.line[LINE_CPUID1].cursor++]=' ';
-			 sprintf(&header.line[LINE_CPUID1].buffer[header.line[LINE_CPUID1].cursor],"%1.1d",(cpuid/10));
-			 header.line[LINE_CPUID1].cursor++;
-			 
-			 while (header.line[LINE_CPUID2].cursor < offset) header.line[LINE_CPUID2].buffer[header.line[LINE_CPUID2].cursor++]=' ';
-			 sprintf(&header.line[LINE_CPUID2].buffer[header.line[LINE_CPUID2].cursor],"%1.1d",(cpuid%10));
-			 header.line[LINE_CPUID2].cursor++;
-			 
-			 offset++;
-		    }
-		    if (t<topology.map[s].thread_count-1) offset++; // '|'
-	       }
-	       if (s<topology.number_of_sockets-1) offset++; // ' ' 
-	  }
+	  offset = header_add_cpus(offset);
 	  offset+=2;
      }
+     
+     // the softirq matrix sits to the right of the other metrics, with a gutter for the vector names 
+     header.matrix_offset = offset;
+     if (softirq_matrix.enabled) {
+	  header_puts(LINE_METRIC,offset,"softirq ALL");
+	  offset = header_add_cpus(offset+SOFTIRQ_GUTTER);
+     }
      return;
 }
 
 void print_header()
 {
      int i;
-     for (i=0;i<LINE_COUNT;i++) fprintf(stdout,"%s\n",header.line[i].buffer);
+     for (i=0;i<LINE_CPUID1+header.cpuid_digits;i++) fprintf(stdout,"%s\n",header.line[i].buffer);
+     return;
+}
+
+// merge a row of per cpu deltas into the columns of a fold, by sum or max (-A) 
+void fold_deltas(struct fold_layout *f, unsigned long int *delta, int cpu_count, unsigned long int *column)
+{
+     int c,k;
+     
+     memset((void *)column,0,sizeof(unsigned long int)*f->column_count);
+     for (c=0;c<cpu_count;c++) {
+	  if ((k = f->column_of[c]) < 0) continue;
+	  if (fold_sum) column[k] += delta[c];
+	  else if (delta[c] > column[k]) column[k] = delta[c];
+     }
+     return;
+}
+
+// print one character per column of a fold. level is the color index for each column, 
+// glyph the character to show. If glyph is NULL the level is shown from scale_glyphs. 
+void display_cpu_row(struct fold_layout *f, unsigned int *level, char *glyph)
+{
+     int k;
+     
+     for (k=0;k<f->column_count;k++) {
+	  unsigned int value = level[k];
+	  
+	  if (f->columns[k].separator) fprintf(stdout,"%s%c",C_RESET,f->columns[k].separator);
+	  if (value >= scale_levels) value=scale_levels - 1;
+	  fprintf(stdout,"%s%s%s%c",C_START,scale_ramp[value],C_END,(glyph == NULL) ? scale_glyphs[value] : glyph[k]);
+     }
+     return;
+}
+
+// the softirq matrix is one row per vector followed by a 'top' row, which shows the index of 
+// the vector with the largest delta on each column. The first row continues the line started by 
+// display_metric_heatmap, the rest are padded out to line up underneath it. 
+void display_softirq_matrix()
+{
+     int v,c,k;
+     int cpu_count = topology.number_of_cpus;
+     unsigned int level[MAX_CPUS], top_level[MAX_CPUS];
+     unsigned long int delta[MAX_CPUS], column[MAX_CPUS], top_delta[MAX_CPUS];
+     char top_glyph[MAX_CPUS];
+     
+     for (k=0;k<fold.column_count;k++) {
+	  top_delta[k]=0;
+	  top_level[k]=0;
+	  top_glyph[k]='-';
+     }
+     
+     for (v=0;v<softirq_matrix.vector_count;v++) {
+	  for (c=0;c<cpu_count;c++) delta[c] = softirq_matrix.current[v][c] - softirq_matrix.previous[v][c];
+	  fold_deltas(&fold,delta,cpu_count,column);
+	  irqscale_quantize_row(&softirq_matrix.scale,column,level,fold.column_count);
+	  for (k=0;k<fold.column_count;k++) {
+	       if (column[k] > top_delta[k]) {
+		    top_delta[k]=column[k];
+		    top_level[k]=level[k];
+		    top_glyph[k]='0'+v;
+	       }
+	  }
+	  if (v>0) fprintf(stdout,"\n%*s",header.matrix_offset,"");
+	  fprintf(stdout,"%d:%-*.*s",v,SOFTIRQ_GUTTER-2,SOFTIRQ_GUTTER-3,softirq_matrix.label[v]); // v is a single digit
+	  display_cpu_row(&fold,level,NULL);
+	  fprintf(stdout,"%s",C_RESET);
+     }
+     fprintf(stdout,"\n%*s%-*s",header.matrix_offset,"",SOFTIRQ_GUTTER,"top");
+     display_cpu_row(&fold,top_level,top_glyph);
+     fprintf(stdout,"%s",C_RESET);
      return;
 }
 
 // iterate through the metrics and system topology and then display the result as a heatmap. 
 void display_metric_heatmap(time_t now, int interval_count)
 {
-     int m,s,t,c;
+     int m,c;
      struct tm *tmp;
      char timestamp[256];
-     unsigned long int sum;
+     unsigned int level[MAX_CPUS];
+     unsigned long int delta[MAX_CPUS], column[MAX_CPUS];
      
      tmp = localtime(&now);
      strftime(timestamp,sizeof(timestamp),"%H:%M:%S",tmp);
      fprintf(stdout,"%8s: ",timestamp); // 10 characters
      for (m=0;m<metric_count;m++) {
-	  for (s=0;s<topology.number_of_sockets;s++) {
-	       for (t=0;t<topology.map[s].thread_count;t++) {
-		    sum=0;
-		    for (c=0;c<topology.map[s].threads[t].core_count;c++){
-			 int cpuid = topology.map[s].threads[t].cores[c].cpu_id;
-			 int delta = metrics[m].current[cpuid] - metrics[m].previous[cpuid];
-			 int value;
-			 
-			 value = shift_log2(delta);
-			 sum+=value;
-			 if (value >= max_colors) value=max_colors - 1;
-			 fprintf(stdout,"%s%s%s%x",C_START,colors[value],C_END,value);
+	  for (c=0;c<topology.number_of_cpus;c++) delta[c] = metrics[m].current[c] - metrics[m].previous[c];
+	  fold_deltas(&fold,delta,topology.number_of_cpus,column);
+	  irqscale_quantize_row(&metrics[m].scale,column,level,fold.column_count);
+	  display_cpu_row(&fold,level,NULL);
+	  fprintf(stdout,"%s  ",C_RESET);
+     }
+     if (softirq_matrix.enabled) display_softirq_matrix();
+     printf("\n");
+     return;
+}
+// -m. The gutter holds the host name on each host's line 
+#define MERGE_GUTTER 16
+
+// -m. The metrics shown, matched across the hosts by label. Each is a group as wide as the widest host
+// or its label, whichever is wider, so every host's columns line up under the header 
+struct merge_series_struct {
+     char label[MAX_HOSTNAME];
+     int width;
+     int index[MAX_HOSTS];   // the host's series with this label, -1 if it didn't record it 
+     struct scale_struct scale;
+} merge_series[MAX_SERIES];
+
+int merge_series_count;
+
+void merge_add_series(char *label, struct scale_struct *scale)
+{
+     int s;
+     
+     for (s=0;s<merge_series_count;s++) if (strcmp(merge_series[s].label,label) == 0) return;
+     if (merge_series_count >= MAX_SERIES) return;
+     snprintf(merge_series[s].label,MAX_HOSTNAME,"%s",label);
+     merge_series[s].scale = *scale;
+     merge_series_count++;
+     return;
+}
+
+// the metric options pick the series, with their -Q scales, e.g. -C sys is "cpu sys" and -S ALL is every
+// "softirq" row. Without any, everything that was recorded. Exits if a metric asked for isn't in any file 
+void select_merge_series()
+{
+     struct merge_host *h;
+     int i,s,m,k;
+     
+     for (m=0;m<metric_count;m++) merge_add_series(metrics[m].label,&metrics[m].scale);
+     for (i=0;i<irqmerge_host_count();i++) {
+	  h = irqmerge_host(i);
+	  for (k=0;k<h->series_count;k++) {
+	       if ((softirq_matrix.enabled) && (strncmp(h->label[k],"softirq ",8) == 0)) merge_add_series(h->label[k],&softirq_matrix.scale);
+	       if ((metric_count == 0) && (!softirq_matrix.enabled)) merge_add_series(h->label[k],&default_scale);
+	  }
+     }
+     if ((softirq_matrix.enabled) && (merge_series_count == metric_count)) {
+	  fprintf(stderr,"-S ALL, but none of the recordings have the softirq matrix\n");
+	  exit(-1);
+     }
+     for (s=0;s<merge_series_count;s++) {
+	  int found = 0;
+	  
+	  for (i=0;i<irqmerge_host_count();i++) {
+	       h = irqmerge_host(i);
+	       merge_series[s].index[i] = -1;
+	       for (k=0;k<h->series_count;k++) if (strcmp(h->label[k],merge_series[s].label) == 0) merge_series[s].index[i] = k;
+	       if (merge_series[s].index[i] >= 0) found++;
+	  }
+	  if (!found) {
+	       fprintf(stderr,"none of the recordings have %s\n",merge_series[s].label);
+	       exit(-1);
+	  }
+     }
+     return;
+}
+
+// set each group's width for the hosts' current folds, and return the width of a line 
+int merge_widths()
+{
+     int i,s,width = 10 + MERGE_GUTTER;
+     
+     for (s=0;s<merge_series_count;s++) {
+	  merge_series[s].width = strlen(merge_series[s].label);
+	  for (i=0;i<irqmerge_host_count();i++) {
+	       if (irqmerge_host(i)->fold->width > merge_series[s].width) merge_series[s].width = irqmerge_host(i)->fold->width;
+	  }
+	  width += merge_series[s].width + 2;
+     }
+     return width;
+}
+
+void print_merge_header()
+{
+     int s;
+     
+     fprintf(stdout,"%-10s%-*s","Time",MERGE_GUTTER,"Host");
+     for (s=0;s<merge_series_count;s++) fprintf(stdout,"%-*s  ",merge_series[s].width,merge_series[s].label);
+     fprintf(stdout,"\n");
+     return;
+}
+
+// -m. Replay the json recordings of several hosts side by side, a line per host per interval, with the
+// times lined up after each file's clock offset. Hosts keep their own topology; folded, a column per socket. 
+// Each metric has one scale across all the hosts, so the colors compare between them.
+void display_merge(int interval)
+{
+     unsigned int level[MAX_CPUS];
+     unsigned long int column[MAX_CPUS];
+     struct merge_host *h;
+     char timestamp[256];
+     int i,s,width,lines = 0;
+     int host_count = irqmerge_host_count();
+     long bucket;
+     
+     irqmerge_start(interval);
+     select_merge_series();
+     
+     // unfolded only if every host fits the terminal, so the hosts line up the same way 
+     for (i=0;i<host_count;i++) {
+	  h = irqmerge_host(i);
+	  irqnuma_build_fold_sockets((fold_mode < 0) ? FOLD_NONE : fold_mode,h->socket_of,h->cpu_count,h->fold);
+     }
+     width = terminal_width();
+     if ((fold_mode < 0) && (width > 0) && (merge_widths() > width)) {
+	  for (i=0;i<host_count;i++) {
+	       h = irqmerge_host(i);
+	       irqnuma_build_fold_sockets(FOLD_NODE,h->socket_of,h->cpu_count,h->fold);
+	  }
+     }
+     merge_widths();
+     
+     while ((bucket = irqmerge_next_bucket()) >= 0) {
+	  time_t now = bucket*interval;
+	  
+	  if ((lines++ % 60) == 0) print_merge_header();
+	  strftime(timestamp,sizeof(timestamp),"%H:%M:%S",localtime(&now));
+	  for (i=0;i<host_count;i++) {
+	       h = irqmerge_host(i);
+	       if (i == 0) fprintf(stdout,"%8s: ",timestamp); else fprintf(stdout,"%10s","");
+	       fprintf(stdout,"%-*.*s",MERGE_GUTTER,MERGE_GUTTER-1,h->name);
+	       if (!h->present) {
+		    fprintf(stdout,"-\n"); // no record from this host in this interval 
+		    continue;
+	       }
+	       for (s=0;s<merge_series_count;s++) {
+		    int k = merge_series[s].index[i];
+		    
+		    if (k < 0) {
+			 fprintf(stdout,"%-*s  ",merge_series[s].width,"-"); // this host didn't record it 
+			 continue;
 		    }
-		    if (t<topology.map[s].thread_count-1) fprintf(stdout,"%s|",C_RESET);
+		    fold_deltas(h->fold,&h->delta[k*h->cpu_count],h->cpu_count,column);
+		    irqscale_quantize_row(&merge_series[s].scale,column,level,h->fold->column_count);
+		    display_cpu_row(h->fold,level,NULL);
+		    fprintf(stdout,"%s%*s  ",C_RESET,merge_series[s].width - h->fold->width,"");
 	       }
-	       if (s<topology.number_of_sockets-1) fprintf(stdout,"%s ",C_RESET);
+	       fprintf(stdout,"\n");
 	  }
-	  fprintf(stdout,"%s  ",C_RESET);
      }
-     printf("\n");
      return;
 }
+
+// -H. A line typed while running, "<intervals back> [fold] [scale]" e.g. "600 l3 lin:0:1000", shows a
+// screenful of the history from that many intervals ago, folded and scaled that way, then the live view
+// carries on. Without a fold or scale it's the live one. Metrics are side by side, a line per interval. 
+void display_history(char *command)
+{
+     static struct fold_layout layout;
+     static struct scale_struct scale[MAX_SERIES];
+     struct scale_struct override;
+     int width[MAX_SERIES];
+     unsigned long int delta[MAX_CPUS], column[MAX_CPUS];
+     unsigned int level[MAX_CPUS];
+     struct winsize ws;
+     char *word, *endptr, timestamp[64];
+     long back, number, last, rows = 20;
+     int s, v, mode = fold.mode, overridden = 0, series_count = irqhist_series_count();
+     time_t time;
+     
+     back = strtol(command,&endptr,10);
+     if ((endptr == command) || (back < 0)) {
+	  fprintf(stdout,"history: type <intervals back> [none|core|l3|node] [log|lin|pct[:floor[:ceiling]]], e.g. 600 l3 lin\n");
+	  return;
+     }
+     override = default_scale;
+     for (word=strtok(endptr," \t\n");word!=NULL;word=strtok(NULL," \t\n")) {
+	  for (v=FOLD_COUNT-1;v>=0;v--) if (strcmp(word,fold_names[v]) == 0) break;
+	  if (v >= 0) mode = v;
+	  else if (irqscale_parse(&override,word) == 0) overridden = 1;
+	  else {
+	       fprintf(stdout,"history: %s isn't a fold or a scale\n",word);
+	       return;
+	  }
+     }
+     
+     // the same order they were given to the history in init_export 
+     for (s=0;s<metric_count;s++) scale[s] = metrics[s].scale;
+     for (;s<series_count;s++) scale[s] = softirq_matrix.scale;
+     for (s=0;overridden && (s<series_count);s++) scale[s] = override;
+     irqnuma_build_fold(mode,&layout);
+     if ((ioctl(STDOUT_FILENO,TIOCGWINSZ,&ws) == 0) && (ws.ws_row > 3)) rows = ws.ws_row - 3;
+     
+     last = irqhist_next() - 1;
+     number = last - back;
+     if (number < irqhist_first()) number = irqhist_first();
+     fprintf(stdout,"history: %ld of %ld intervals held in %lu bytes, fold %s\n",last - irqhist_first() + 1,last + 1,
+	     (unsigned long)irqhist_bytes(),fold_names[mode]);
+     fprintf(stdout,"%-10s","Time");
+     // a metric is as wide as its label if that's wider than the columns, as the live header prints them whole 
+     for (s=0;s<series_count;s++) {
+	  width[s] = strlen(irqhist_label(s));
+	  if (layout.width > width[s]) width[s] = layout.width;
+	  fprintf(stdout,"%-*s  ",width[s],irqhist_label(s));
+     }
+     fprintf(stdout,"\n");
+     for (;(rows > 0) && (number <= last);number++,rows--) {
+	  for (s=0;s<series_count;s++) {
+	       if (irqhist_read(number,s,delta,&time) < 0) break;
+	       if (s == 0) {
+		    strftime(timestamp,sizeof(timestamp),"%H:%M:%S",localtime(&time));
+		    fprintf(stdout,"%8s: ",timestamp);
+	       }
+	       fold_deltas(&layout,delta,topology.number_of_cpus,column);
+	       irqscale_quantize_row(&scale[s],column,level,layout.column_count);
+	       display_cpu_row(&layout,level,NULL);
+	       fprintf(stdout,"%s%*s  ",C_RESET,width[s] - layout.width,"");
+	  }
+	  fprintf(stdout,"\n");
+     }
+     fprintf(stdout,"history: back to live\n");
+     return;
+}
+
+// -H commands come in on stdin. Only one read, once poll says there's something, so a partial line on a
+// pipe can't hold up sampling. It waits in line until the rest comes. Returns 0 once stdin is closed 
+int check_history_command()
+{
+     static char line[256];
+     static int length;
+     struct pollfd fd = { STDIN_FILENO, POLLIN, 0 };
+     char *end;
+     int n;
+     
+     if ((poll(&fd,1,0) <= 0) || (!(fd.revents & (POLLIN|POLLHUP)))) return 1;
+     if ((n = read(STDIN_FILENO,line+length,sizeof(line)-1-length)) < 0) return (errno == EINTR) || (errno == EAGAIN);
+     if (n == 0) return 0;
+     length += n;
+     line[length] = '\0';
+     while ((end = strchr(line,'\n')) != NULL) {
+	  *end = '\0';
+	  display_history(line);
+	  length -= end+1 - line;
+	  memmove(line,end+1,length+1);
+     }
+     if (length == sizeof(line)-1) length = 0; // no command is that long 
+     return 1;
+}
+
+// hand the metrics and softirq matrix rows to the -o sinks and the -H history. They read the same buffers as the display
+void init_export()
+{
+     static int socket_of[MAX_CPUS];
+     int m,v,s,t,c;
+     
+     for (s=0;s<topology.number_of_sockets;s++) {
+	  for (t=0;t<topology.map[s].thread_count;t++) {
+	       for (c=0;c<topology.map[s].threads[t].core_count;c++) socket_of[topology.map[s].threads[t].cores[c].cpu_id] = s;
+	  }
+     }
+     irqexport_set_sockets(socket_of);
+     for (m=0;m<metric_count;m++) {
+	  irqexport_add_series(metrics[m].label,metrics[m].current,metrics[m].previous);
+	  irqhist_add_series(metrics[m].label,metrics[m].current,metrics[m].previous);
+     }
+     if (softirq_matrix.enabled) {
+	  // the rows are named by the first read. Ones the kernel doesn't have stay without a name and aren't kept 
+	  gather_softirq_matrix();
+	  for (v=0;v<N_SOFTIRQ_VECTORS;v++) {
+	       if (!softirq_matrix.export_label[v][0]) continue;
+	       irqexport_add_series(softirq_matrix.export_label[v],softirq_matrix.current[v],softirq_matrix.previous[v]);
+	       irqhist_add_series(softirq_matrix.export_label[v],softirq_matrix.current[v],softirq_matrix.previous[v]);
+	  }
+     }
+     return;
+}
+
+// -X. Each cpu's sys, irq and softirq time from /proc/stat is its load, and every interrupt and softirq
+// vector is correlated against it. Instead of the heatmap, a report of the vectors that follow each
+// cpu's load is printed once a window. 
+void correlate(int interval, time_t end, int window)
+{
+     static struct metrics_struct load[3];
+     int columns[3] = { 3, 6, 7 }; // sys, irq, softirq, as get_procstat_column numbers them 
+     unsigned long int total[MAX_CPUS];
+     int k,c,interval_count = 0;
+     time_t now = time(NULL);
+     
+     for (k=0;k<3;k++) load[k].index = columns[k];
+     irqcorr_init(window,topology.number_of_cpus);
+     while (now < end) {
+	  for (k=0;k<3;k++) gather_cpu_metrics(&load[k]);
+	  irqcorr_gather();
+	  if (interval_count > 0) {
+	       for (c=0;c<topology.number_of_cpus;c++) {
+		    total[c] = 0;
+		    for (k=0;k<3;k++) total[c] += load[k].current[c] - load[k].previous[c];
+	       }
+	       irqcorr_update(total);
+	       if ((interval_count % window) == 0) {
+		    irqcorr_report(stdout,now);
+		    fflush(stdout);
+	       }
+	  } else {
+	       irqcorr_update(NULL); // the first has no previous 
+	  }
+	  for (k=0;k<3;k++) memcpy(load[k].previous,load[k].current,sizeof(load[k].previous));
+	  sleep(interval);
+	  interval_count ++;
+	  now  = time(NULL);
+     }
+     return;
+}
+
+// A signal ends the loop rather than the process, so the -T summary still gets printed and the exit
+// handlers run, e.g. the one that unlinks an -o shm segment 
+volatile sig_atomic_t stopping;
+
+void stop(int sig)
+{
+     stopping = 1;
+     return;
+}
+
 // flip the current and previous buffers. 
 void advance_metrics()
 {
@@ -471,6 +993,7 @@ void advance_metrics()
      for (m=0;m<metric_count;m++) {
 	  memcpy(metrics[m].previous,metrics[m].current,sizeof(metrics[m].previous));
      }
+     if (softirq_matrix.enabled) memcpy(softirq_matrix.previous,softirq_matrix.current,sizeof(softirq_matrix.previous));
      return;
 }
 
@@ -479,23 +1002,29 @@ int main(int argc,char *argv[])
      extern char *optarg;
      extern int optind;
      
-     int opt, interval_count;
+     int opt, interval_count, m;
      
      time_t now,start,end;
      
      int interval = 1;
      int timespan = -1;
+     int topology_cache = 0;
+     int display = 1;
+     int daemonize = 0;
+     int correlate_window = 0;
+     int topology_phase, gather_phase[MAX_METRICS], matrix_phase, advance_phase, render_phase, history_phase, scrollback_phase, output_phase;
+     int history_commands = 1;
      
-     const char *optstring="C:I:S:M:P:t:i:Z:h";
+     const char *optstring="C:I:S:M:P:t:i:Z:F:A:Q:R:o:m:X:H:qDcTh";
 
      colors = bgy_scale;
      
-     irqnuma_init_topology();
-     
      metric_count = 0;
      memset((void *)metrics,0,sizeof(struct metrics_struct)*MAX_METRICS);
      
      while ((opt = getopt(argc, argv, optstring))!= -1) {
+	  int added = metric_count;
+	  
 	  switch (opt) {
 	  case 'C':
 	       metrics[metric_count].type=TYPE_CPU;
@@ -512,6 +1041,12 @@ int main(int argc,char *argv[])
 	       metric_count ++;
 	       break;
 	  case 'S':
+	       if (strcmp(optarg,"ALL") == 0) {
+		    softirq_matrix.enabled = 1;
+		    softirq_matrix.scale = default_scale;
+		    last_scale = &softirq_matrix.scale;
+		    break;
+	       }
 	       metrics[metric_count].type=TYPE_SOFTIRQ;
 	       strncpy(metrics[metric_count].label,optarg,MAX_LABEL-1);
 	       metrics[metric_count].label_length = strlen(metrics[metric_count].label);
@@ -537,6 +1072,52 @@ int main(int argc,char *argv[])
 	  case 'i':
 	       interval = atoi(optarg);
 	       break;
+	  case 'F':
+	       for (fold_mode=FOLD_COUNT-1;fold_mode>=0;fold_mode--) if (strcmp(optarg,fold_names[fold_mode]) == 0) break;
+	       if ((fold_mode < 0) && (strcmp(optarg,"auto") != 0)) usage(argv);
+	       break;
+	  case 'A':
+	       if (strcmp(optarg,"sum") == 0) fold_sum = 1;
+	       else if (strcmp(optarg,"max") == 0) fold_sum = 0;
+	       else usage(argv);
+	       break;
+	  case 'Q':
+	       if (irqscale_parse(last_scale,optarg) < 0) usage(argv);
+	       break;
+	  case 'R':
+	       if (irqscale_set_levels(atoi(optarg)) < 0) usage(argv);
+	       break;
+	  case 'o':
+	       if (irqexport_add_sink(optarg) < 0) {
+		    fprintf(stderr,"Could not set up output %s: %s\n",optarg,strerror(errno));
+		    exit(-1);
+	       }
+	       break;
+	  case 'm':
+	       if (irqmerge_add_source(optarg) < 0) {
+		    fprintf(stderr,"Could not open recording %s: %s\n",optarg,strerror(errno));
+		    exit(-1);
+	       }
+	       break;
+	  case 'X':
+	       if ((correlate_window = atoi(optarg)) < 2) usage(argv);
+	       break;
+	  case 'q':
+	       display = 0;
+	       break;
+	  case 'D':
+	       display = 0;
+	       daemonize = 1;
+	       break;
+	  case 'c':
+	       topology_cache = 1;
+	       break;
+	  case 'T':
+	       irqcost_enable();
+	       break;
+	  case 'H':
+	       if (irqhist_set_budget(optarg) < 0) usage(argv);
+	       break;
 	  case 'Z':
 	       // default is bgy
 	       if (strncmp(optarg,"red",3) == 0) colors=red_temp_scale;
@@ -547,6 +1128,10 @@ int main(int argc,char *argv[])
 	  default:
 	       usage(argv);
 	  }
+	  if (metric_count > added) {
+	       metrics[added].scale = default_scale;
+	       last_scale = &metrics[added].scale;
+	  }
 	  
 	  if (metric_count >= MAX_METRICS) {
 	       fprintf(stderr,"I can only handle %d metrics, please reduce number of arguments or increase MAX_METRICS\n",MAX_METRICS);
@@ -554,10 +1139,63 @@ int main(int argc,char *argv[])
 	  }
      }
 
-     if (metric_count == 0) usage(argv);
+     // -m replays recordings rather than watching this machine, so there is nothing to export, keep or measure 
+     if (irqmerge_host_count() > 0) {
+	  if ((!display) || (irqexport_enabled()) || (irqhist_enabled()) || (irqcost_enabled()) || (correlate_window > 0)) {
+	       fprintf(stderr,"-m only replays recordings to the terminal, so it can't be used with -o, -q, -D, -H, -T or -X\n");
+	       exit(-1);
+	  }
+	  irqscale_build_ramp(colors,max_colors);
+	  display_merge(interval);
+	  return 0;
+     }
+     
+     // -X needs no metrics, it reads every vector 
+     if (correlate_window > 0) {
+	  if (topology_cache) irqnuma_init_topology_cached(TOPOLOGY_CACHE_PATH); else irqnuma_init_topology();
+	  correlate(interval,(timespan > -1) ? time(NULL) + timespan : time(NULL) + 100000000,correlate_window);
+	  return 0;
+     }
+     
+     if ((metric_count == 0) && (!softirq_matrix.enabled)) usage(argv);
+     if ((!display) && (!irqexport_enabled())) usage(argv);
+     if ((!display) && (irqhist_enabled())) {
+	  fprintf(stderr,"-H history is only shown in the live view, so it can't be used with -q or -D\n");
+	  exit(-1);
+     }
+     
+     irqscale_build_ramp(colors,max_colors);
+
+     // the topology isn't needed until here, and -c may have asked for the cached copy 
+     topology_phase = irqcost_phase("topology");
+     irqcost_begin(topology_phase);
+     if (topology_cache) irqnuma_init_topology_cached(TOPOLOGY_CACHE_PATH); else irqnuma_init_topology();
+     irqcost_end(topology_phase);
+     
+     // -T phases, a gather for each metric so the expensive sources show up 
+     for (m=0;m<metric_count;m++) {
+	  char name[COST_NAME];
+	  
+	  snprintf(name,sizeof(name),"gather %s",metrics[m].label);
+	  gather_phase[m] = irqcost_phase(name);
+     }
+     matrix_phase = irqcost_phase("gather softirq ALL");
+     // advance is only the copy of current into previous. The per cpu deltas are taken where they're used,
+     // so they count in render (with the fold and quantize) and in output (each sink) 
+     advance_phase = irqcost_phase("advance");
+     render_phase = irqcost_phase("render");
+     history_phase = irqcost_phase("history");
+     scrollback_phase = irqcost_phase("scrollback");
+     output_phase = irqcost_phase("output");
+     signal(SIGINT,stop);
+     signal(SIGTERM,stop);
 
      // create the header 
      init_header(metric_count);
+     init_export();
+     
+     // everything that can fail has been set up, so it's safe to go into the background 
+     if ((daemonize) && (daemon(1,0) < 0)) error();
      
      // start the loop. 
      start = time(NULL);
@@ -567,11 +1205,11 @@ int main(int argc,char *argv[])
      } else {
 	  end = start + 100000000 ; // many
      }
-     print_header();
+     if (display) print_header();
      interval_count = 0;
-     while (now < end) {
-	  int m;
+     while ((now < end) && (!stopping)) {
 	  for (m=0;m<metric_count;m++) {
+	       irqcost_begin(gather_phase[m]);
 	       switch (metrics[m].type) {
 	       case TYPE_CPU:
 		    gather_cpu_metrics(&metrics[m]);
@@ -592,13 +1230,41 @@ int main(int argc,char *argv[])
 		    fprintf(stderr,"unknown metric type, internal consistency error\n");
 		    exit(-1);
 	       }
+	       irqcost_end(gather_phase[m]);
+	  }
+	  if (softirq_matrix.enabled) {
+	       irqcost_begin(matrix_phase);
+	       gather_softirq_matrix();
+	       irqcost_end(matrix_phase);
+	  }
+	  irqcost_begin(render_phase);
+	  if (display) {
+	       display_metric_heatmap(now,interval_count);
+	       if (irqcost_enabled()) fflush(stdout); // so the terminal writes land in this phase 
 	  }
-	  display_metric_heatmap(now,interval_count);
+	  irqcost_end(render_phase);
+	  irqcost_begin(output_phase);
+	  if (interval_count > 0) irqexport_snapshot(now,interval,topology.number_of_cpus); // the first has no previous 
+	  irqcost_end(output_phase);
+	  if ((irqhist_enabled()) && (interval_count > 0)) {
+	       irqcost_begin(history_phase);
+	       irqhist_append(now,topology.number_of_cpus);
+	       irqcost_end(history_phase);
+	  }
+	  irqcost_begin(advance_phase);
 	  advance_metrics();
-	  sleep(interval);
+	  irqcost_end(advance_phase);
+	  irqexport_wait(interval);
+	  if ((irqhist_enabled()) && (display) && (history_commands)) {
+	       irqcost_begin(scrollback_phase);
+	       history_commands = check_history_command();
+	       irqcost_end(scrollback_phase);
+	  }
 	  interval_count ++;
-	  if ((interval_count % 60)==0) print_header();
+	  if ((interval_count % 60)==0) irqcost_status(stderr);
+	  if ((display) && ((interval_count % 60)==0)) print_header();
 	  now  = time(NULL);
      }
+     irqcost_summary(stderr);
      return 0;
 }
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "irq_export.h"
+#include "irq_history.h"
+
+static size_t budget;
+static int series_count;
+static struct export_series series[MAX_SERIES];
+static int cpu_count;
+
+// sealed chunks, oldest first. chunk k holds intervals (first_chunk+k)*HISTORY_CHUNK onwards
+static struct history_chunk *chunks;
+static long chunk_count, chunk_capacity, first_chunk;
+static size_t chunk_bytes;
+
+// the chunk being filled, [series][cpu][interval], so it seals a column at a time
+static unsigned long int *staging;
+static time_t staging_time[HISTORY_CHUNK];
+static int staging_count;
+
+// the last chunk decoded, laid out as staging. Reading a screenful in order decodes each chunk once
+static unsigned long int *decoded;
+static long decoded_chunk = -1;
+
+// <bytes> with an optional K, M or G, e.g. 256M
+int irqhist_set_budget(char *spec)
+{
+     char *endptr;
+
+     budget = strtoul(spec,&endptr,10);
+     switch (*endptr) {
+     case 'G': budget <<= 10;
+     case 'M': budget <<= 10;
+     case 'K': budget <<= 10;
+	  endptr++;
+     }
+     if ((*endptr != '\0') || (budget == 0)) return -1;
+     return 0;
+}
+
+int irqhist_enabled()
+{
+     return (budget > 0);
+}
+
+void irqhist_add_series(char *label, unsigned long int *current, unsigned long int *previous)
+{
+     if (series_count >= MAX_SERIES) return;
+     series[series_count].label = label;
+     series[series_count].current = current;
+     series[series_count].previous = previous;
+     series_count++;
+     return;
+}
+
+int irqhist_series_count()
+{
+     return series_count;
+}
+
+char *irqhist_label(int s)
+{
+     return series[s].label;
+}
+
+long irqhist_first()
+{
+     return first_chunk*HISTORY_CHUNK;
+}
+
+// the number the next interval will get, so the newest held is irqhist_next()-1
+long irqhist_next()
+{
+     return (first_chunk + chunk_count)*HISTORY_CHUNK + staging_count;
+}
+
+size_t irqhist_bytes()
+{
+     return chunk_bytes + sizeof(unsigned long int)*series_count*cpu_count*HISTORY_CHUNK;
+}
+
+// one column, HISTORY_CHUNK values, into out: a byte of width then HISTORY_CHUNK*width bits.
+// Returns the end of what it wrote
+static unsigned char *pack_column(unsigned long int *value, unsigned char *out)
+{
+     uint64_t zigzag[HISTORY_CHUNK], all = 0, previous = 0, acc = 0;
+     int i, width, bits = 0;
+
+     for (i=0;i<HISTORY_CHUNK;i++) {
+	  int64_t d = (int64_t)(value[i] - previous);
+
+	  previous = value[i];
+	  zigzag[i] = ((uint64_t)d << 1) ^ (uint64_t)(d >> 63);
+	  all |= zigzag[i];
+     }
+     width = (all == 0) ? 0 : 64 - __builtin_clzl(all);
+     if (width > HISTORY_RAW) width = 64;
+     *out++ = width;
+     if (width == 64) {
+	  memcpy(out,zigzag,sizeof(zigzag));
+	  return out + sizeof(zigzag);
+     }
+     // width is at most HISTORY_RAW, so with under a byte pending it fits in acc
+     for (i=0;(width > 0) && (i<HISTORY_CHUNK);i++) {
+	  acc |= zigzag[i] << bits;
+	  bits += width;
+	  while (bits >= 8) {
+	       *out++ = acc;
+	       acc >>= 8;
+	       bits -= 8;
+	  }
+     }
+     return out;
+}
+
+static unsigned char *unpack_column(unsigned char *in, unsigned long int *value)
+{
+     uint64_t zigzag[HISTORY_CHUNK], previous = 0, acc = 0, mask;
+     int i, width = *in++, bits = 0;
+
+     if (width == 0) {
+	  memset((void *)zigzag,0,sizeof(zigzag));
+     } else if (width == 64) {
+	  memcpy(zigzag,in,sizeof(zigzag));
+	  in += sizeof(zigzag);
+     } else {
+	  mask = (1UL << width) - 1;
+	  for (i=0;i<HISTORY_CHUNK;i++) {
+	       while (bits < width) {
+		    acc |= (uint64_t)*in++ << bits;
+		    bits += 8;
+	       }
+	       zigzag[i] = acc & mask;
+	       acc >>= width;
+	       bits -= width;
+	  }
+     }
+     for (i=0;i<HISTORY_CHUNK;i++) {
+	  previous += (zigzag[i] >> 1) ^ -(zigzag[i] & 1);
+	  value[i] = previous;
+     }
+     return in;
+}
+
+static void drop_oldest()
+{
+     int s;
+
+     for (s=0;s<series_count;s++) free(chunks[0].data[s]);
+     chunk_bytes -= chunks[0].size;
+     memmove(&chunks[0],&chunks[1],(chunk_count-1)*sizeof(struct history_chunk));
+     chunk_count--;
+     first_chunk++;
+     decoded_chunk = -1;
+     return;
+}
+
+static void seal_chunk()
+{
+     static unsigned char *packed;
+     struct history_chunk *h;
+     int s,c;
+
+     if (packed == NULL) packed = malloc((size_t)cpu_count*(1 + sizeof(uint64_t)*HISTORY_CHUNK));
+     if (chunk_count == chunk_capacity) {
+	  chunk_capacity = (chunk_capacity > 0) ? chunk_capacity*2 : 64;
+	  chunks = realloc(chunks,chunk_capacity*sizeof(struct history_chunk));
+     }
+     if ((packed == NULL) || (chunks == NULL)) {
+	  fprintf(stderr,"unable to allocate history\n");
+	  exit(-1);
+     }
+     h = &chunks[chunk_count];
+     memcpy(h->time,staging_time,sizeof(staging_time));
+     h->size = sizeof(struct history_chunk);
+     for (s=0;s<series_count;s++) {
+	  unsigned char *out = packed;
+	  size_t size;
+
+	  for (c=0;c<cpu_count;c++) out = pack_column(&staging[((size_t)s*cpu_count + c)*HISTORY_CHUNK],out);
+	  size = out - packed;
+	  if ((h->data[s] = malloc(size)) == NULL) {
+	       fprintf(stderr,"unable to allocate history\n");
+	       exit(-1);
+	  }
+	  memcpy(h->data[s],packed,size);
+	  h->size += size;
+     }
+     chunk_bytes += h->size;
+     chunk_count++;
+     staging_count = 0;
+     while ((chunk_count > 0) && (irqhist_bytes() > budget)) drop_oldest();
+     return;
+}
+
+// this interval's deltas, current - previous, as the -o sinks take them
+void irqhist_append(time_t now, int cpus)
+{
+     int s,c;
+
+     if (staging == NULL) {
+	  cpu_count = cpus;
+	  staging = malloc(sizeof(unsigned long int)*series_count*cpu_count*HISTORY_CHUNK);
+	  decoded = malloc(sizeof(unsigned long int)*series_count*cpu_count*HISTORY_CHUNK);
+	  if ((staging == NULL) || (decoded == NULL)) {
+	       fprintf(stderr,"unable to allocate history\n");
+	       exit(-1);
+	  }
+     }
+     for (s=0;s<series_count;s++) {
+	  unsigned long int *column = &staging[(size_t)s*cpu_count*HISTORY_CHUNK + staging_count];
+
+	  for (c=0;c<cpu_count;c++) column[(size_t)c*HISTORY_CHUNK] = series[s].current[c] - series[s].previous[c];
+     }
+     staging_time[staging_count++] = now;
+     if (staging_count == HISTORY_CHUNK) seal_chunk();
+     return;
+}
+
+// interval number's deltas for a series, cpu_count of them, and its time. -1 if it isn't held
+int irqhist_read(long number, int s, unsigned long int *delta, time_t *time)
+{
+     unsigned long int *from;
+     long k = number/HISTORY_CHUNK - first_chunk;
+     int i = number % HISTORY_CHUNK, c;
+
+     if ((staging == NULL) || (number < irqhist_first()) || (number >= irqhist_next()) || (s >= series_count)) return -1;
+     if (k == chunk_count) {
+	  from = staging;
+	  *time = staging_time[i];
+     } else {
+	  if (decoded_chunk != k + first_chunk) {
+	       int t;
+
+	       for (t=0;t<series_count;t++) {
+		    unsigned char *in = chunks[k].data[t];
+
+		    for (c=0;c<cpu_count;c++) in = unpack_column(in,&decoded[((size_t)t*cpu_count + c)*HISTORY_CHUNK]);
+	       }
+	       decoded_chunk = k + first_chunk;
+	  }
+	  from = decoded;
+	  *time = chunks[k].time[i];
+     }
+     for (c=0;c<cpu_count;c++) delta[c] = from[((size_t)s*cpu_count + c)*HISTORY_CHUNK + i];
+     return 0;
+}
@@ -0,0 +1,29 @@
+// needs irq_export.h first, for MAX_SERIES
+#include <stddef.h>
+#include <time.h>
+
+// -H. Every metric's deltas kept in memory under a byte budget, so earlier intervals can be shown again
+// after they've gone from the terminal. A metric's history is a run of chunks of HISTORY_CHUNK intervals
+// stored a cpu at a time. A cpu's column is coded as the change from the interval before (a delta of the
+// deltas), zigzagged so small changes either way are small numbers, and bit-packed at the width of the
+// largest: an idle or steady cpu costs one byte a chunk. Past the budget the oldest chunk goes.
+#define HISTORY_CHUNK 64
+#define HISTORY_RAW 56 // bits. Wider than this and a column is kept as plain 64 bit values
+
+struct history_chunk {
+     time_t time[HISTORY_CHUNK];
+     size_t size;                    // bytes, for the budget
+     unsigned char *data[MAX_SERIES]; // a packed column per cpu, one after another
+};
+
+/* irq_history.c */
+int irqhist_set_budget(char *spec);
+int irqhist_enabled(void);
+void irqhist_add_series(char *label, unsigned long int *current, unsigned long int *previous);
+int irqhist_series_count(void);
+char *irqhist_label(int series);
+void irqhist_append(time_t now, int cpu_count);
+long irqhist_first(void);
+long irqhist_next(void);
+size_t irqhist_bytes(void);
+int irqhist_read(long number, int series, unsigned long int *delta, time_t *time);
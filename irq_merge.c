@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "irq_numa.h"
+#include "irq_export.h"
+#include "irq_merge.h"
+
+static struct merge_host hosts[MAX_HOSTS];
+static int host_count;
+static int bucket_seconds;
+
+// hosts by the bucket of their next record, smallest first
+static int heap[MAX_HOSTS];
+static int heap_count;
+
+// <file> or <file>@<seconds>, the offset to add to that host's clock e.g. trader3.json@-0.4
+int irqmerge_add_source(char *spec)
+{
+     struct merge_host *h;
+     char *at, *endptr;
+
+     if (host_count >= MAX_HOSTS) return -1;
+     h = &hosts[host_count];
+     memset((void *)h,0,sizeof(struct merge_host));
+     h->path = strdup(spec);
+     if ((at = strrchr(h->path,'@')) != NULL) {
+	  h->offset = strtod(at+1,&endptr);
+	  if ((endptr == at+1) || (*endptr != '\0')) return -1;
+	  *at = '\0';
+     }
+     if ((h->fp = fopen(h->path,"r")) == NULL) return -1;
+     host_count++;
+     return 0;
+}
+
+int irqmerge_host_count()
+{
+     return host_count;
+}
+
+struct merge_host *irqmerge_host(int i)
+{
+     return &hosts[i];
+}
+
+// copy a json string, p just past the opening '"', into out. Returns the position after the closing '"'
+static char *parse_string(char *p, char *out, int size)
+{
+     int k = 0;
+
+     while (*p && (*p != '"')) {
+	  if ((*p == '\\') && p[1]) p++;
+	  if (k < size-1) out[k++] = *p;
+	  p++;
+     }
+     out[k] = '\0';
+     return (*p == '"') ? p+1 : NULL;
+}
+
+// the header line written by the json sink: {"host":"name","interval":1,"cpus":4,"socket":[0,0,1,1]}
+static int parse_header(struct merge_host *h)
+{
+     char *p;
+     int c;
+
+     if (getline(&h->line,&h->line_size,h->fp) < 0) return -1;
+     if (((p = strstr(h->line,"\"host\":\"")) == NULL) || (parse_string(p+8,h->name,MAX_HOSTNAME) == NULL)) return -1;
+     if ((p = strstr(h->line,"\"cpus\":")) == NULL) return -1;
+     h->cpu_count = atoi(p+7);
+     if ((h->cpu_count <= 0) || (h->cpu_count > MAX_CPUS)) return -1;
+     if ((p = strstr(h->line,"\"socket\":[")) == NULL) return -1;
+     p += 10;
+
+     h->socket_of = calloc(h->cpu_count,sizeof(int));
+     h->fold = malloc(sizeof(struct fold_layout));
+     if ((h->socket_of == NULL) || (h->fold == NULL)) {
+	  fprintf(stderr,"unable to allocate merge buffers\n");
+	  exit(-1);
+     }
+     for (c=0;c<h->cpu_count;c++) {
+	  h->socket_of[c] = strtol(p,&p,10);
+	  if ((h->socket_of[c] < 0) || (h->socket_of[c] >= MAX_SOCKETS)) h->socket_of[c] = 0;
+	  if (*p == ',') p++;
+     }
+     return 0;
+}
+
+// a series seen for the first time. The record buffers grow to fit, so a host only costs what it recorded
+static void add_series(struct merge_host *h, char *label)
+{
+     size_t old = (size_t)h->series_count*h->cpu_count, size = old + h->cpu_count;
+
+     strcpy(h->label[h->series_count],label);
+     h->next = realloc(h->next,size*sizeof(unsigned long int));
+     h->delta = realloc(h->delta,size*sizeof(unsigned long int));
+     if ((h->next == NULL) || (h->delta == NULL)) {
+	  fprintf(stderr,"unable to allocate merge buffers\n");
+	  exit(-1);
+     }
+     memset((void *)&h->next[old],0,(size-old)*sizeof(unsigned long int));
+     memset((void *)&h->delta[old],0,(size-old)*sizeof(unsigned long int));
+     h->series_count++;
+     return;
+}
+
+// read the next data record into h->next and work out its bucket. Labels are taken from the first,
+// the rest are assumed to have the same metrics in the same order, as the json sink writes them.
+static void read_record(struct merge_host *h)
+{
+     char *p, label[MAX_HOSTNAME];
+     long time;
+     int s,c;
+
+     h->bucket = -1;
+     while (getline(&h->line,&h->line_size,h->fp) >= 0) {
+	  if ((p = strstr(h->line,"\"time\":")) == NULL) continue;
+	  time = strtol(p+7,&p,10);
+	  if ((p = strstr(p,"\"metrics\":{")) == NULL) continue;
+	  p += 11;
+
+	  for (s=0;(p != NULL) && (*p == '"');s++) {
+	       if ((p = parse_string(p+1,label,sizeof(label))) == NULL) break;
+	       if (strncmp(p,":[",2) != 0) break;
+	       p += 2;
+	       if ((s < MAX_SERIES) && (s >= h->series_count)) add_series(h,label);
+	       for (c=0;(*p != ']') && (*p != '\0');c++) {
+		    unsigned long int v = strtoul(p,&p,10);
+
+		    if ((s < MAX_SERIES) && (c < h->cpu_count)) h->next[s*h->cpu_count + c] = v;
+		    if (*p == ',') p++;
+	       }
+	       if (*p != ']') break;
+	       p++;
+	       if (*p == ',') p++;
+	  }
+	  h->bucket = (long)floor((time + h->offset)/bucket_seconds);
+	  return;
+     }
+     return;
+}
+
+static void heap_swap(int a, int b)
+{
+     int t = heap[a];
+
+     heap[a] = heap[b];
+     heap[b] = t;
+     return;
+}
+
+static void heap_push(int i)
+{
+     int k = heap_count++;
+
+     heap[k] = i;
+     while ((k > 0) && (hosts[heap[(k-1)/2]].bucket > hosts[heap[k]].bucket)) {
+	  heap_swap(k,(k-1)/2);
+	  k = (k-1)/2;
+     }
+     return;
+}
+
+static int heap_pop()
+{
+     int top = heap[0], k = 0;
+
+     heap[0] = heap[--heap_count];
+     for (;;) {
+	  int smallest = k, l = 2*k+1, r = 2*k+2;
+
+	  if ((l < heap_count) && (hosts[heap[l]].bucket < hosts[heap[smallest]].bucket)) smallest = l;
+	  if ((r < heap_count) && (hosts[heap[r]].bucket < hosts[heap[smallest]].bucket)) smallest = r;
+	  if (smallest == k) break;
+	  heap_swap(k,smallest);
+	  k = smallest;
+     }
+     return top;
+}
+
+// read every header and first record. Exits on a file that isn't a recording, as a bad -I label does
+void irqmerge_start(int interval)
+{
+     int i;
+
+     bucket_seconds = (interval > 0) ? interval : 1;
+     for (i=0;i<host_count;i++) {
+	  if (parse_header(&hosts[i]) < 0) {
+	       fprintf(stderr,"%s isn't an irq_heatmap json recording, it should start with a {\"host\":...} line\n",hosts[i].path);
+	       exit(-1);
+	  }
+	  read_record(&hosts[i]);
+	  if (hosts[i].bucket >= 0) heap_push(i);
+     }
+     return;
+}
+
+// gather the next bucket: every host with a record in it has it summed into delta and present set.
+// Returns the bucket, time is bucket*interval, or -1 when all the files are done.
+long irqmerge_next_bucket()
+{
+     long bucket;
+     int i;
+
+     if (heap_count == 0) return -1;
+     bucket = hosts[heap[0]].bucket;
+     for (i=0;i<host_count;i++) {
+	  if (hosts[i].present) memset((void *)hosts[i].delta,0,sizeof(unsigned long int)*hosts[i].series_count*hosts[i].cpu_count);
+	  hosts[i].present = 0;
+     }
+     while ((heap_count > 0) && (hosts[heap[0]].bucket == bucket)) {
+	  struct merge_host *h = &hosts[heap_pop()];
+	  int k;
+
+	  for (k=0;k<h->series_count*h->cpu_count;k++) h->delta[k] += h->next[k];
+	  h->present = 1;
+	  read_record(h);
+	  // a record that went back in time (a clock step) joins this bucket rather than being lost
+	  if ((h->bucket >= 0) && (h->bucket < bucket)) h->bucket = bucket;
+	  if (h->bucket >= 0) heap_push(h - hosts);
+     }
+     return bucket;
+}
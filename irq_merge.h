@@ -0,0 +1,34 @@
+// needs irq_numa.h and irq_export.h first, for MAX_CPUS, MAX_SERIES and struct fold_layout 
+#include <stdio.h>
+
+// merging the -o json:<file> recordings of several hosts into one view (-m). Records are bucketed by
+// their time plus the file's clock offset, divided by the interval, and read a bucket at a time in a
+// k-way merge. Memory doesn't grow with the length of the recordings, but it does with the number of
+// hosts: each has a line buffer, two records of the series it recorded and a fold layout for the display.
+#define MAX_HOSTS 64
+#define MAX_HOSTNAME 64
+
+struct merge_host {
+     char name[MAX_HOSTNAME];
+     char *path;
+     FILE *fp;
+     char *line;             // getline buffer
+     size_t line_size;
+     double offset;          // seconds added to this host's clock
+     int cpu_count;
+     int *socket_of;
+     int series_count;
+     char label[MAX_SERIES][MAX_HOSTNAME];
+     long bucket;            // of the next record, -1 once the file is done
+     unsigned long int *next;  // series_count*cpu_count, the next record. Grows as the first one is read
+     unsigned long int *delta; // the current bucket, summed if there was more than one record in it
+     int present;            // has a record in the current bucket
+     struct fold_layout *fold; // for the display
+};
+
+/* irq_merge.c */
+int irqmerge_add_source(char *spec);
+int irqmerge_host_count(void);
+struct merge_host *irqmerge_host(int i);
+void irqmerge_start(int interval);
+long irqmerge_next_bucket(void);
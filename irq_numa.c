@@ -3,6 +3,22 @@
 // yes, I know this is bad
 #define IRQ_PATH_MAX 4096
 
+#define PROC_BOOT_ID "/proc/sys/kernel/random/boot_id"
+#define SYSFS_CPU_ONLINE "/sys/devices/system/cpu/online"
+
+#define TOPOLOGY_CACHE_MAGIC 0x69727174 // 'irqt'
+#define TOPOLOGY_CACHE_VERSION 1
+
+// the cache file is this header followed by struct numa_topology as it sits in memory. 
+// Anything that doesn't match exactly is ignored and the topology is rebuilt. 
+struct topology_cache_header {
+     unsigned int magic;
+     unsigned int version;
+     unsigned int size; // sizeof(struct numa_topology) 
+     char boot_id[64];
+     char online[IRQ_PATH_MAX];
+};
+
 // global for now 
 struct numa_topology topology; 
 
@@ -15,51 +31,43 @@ int irqnuma_num_hyperthreads()
      
      if ((fp = fopen("/sys/devices/system/cpu/cpu0/topology/thread_siblings_list","r")) != NULL) {
 	  while ((ch=fgetc(fp))!=EOF) if (ch == ',') i++;
+	  fclose(fp);
      }
-     fclose(fp);
      return i;
 }
 
+// read a sysfs (or proc) file into buffer, minus the trailing '\n'. Returns the length or -1 
+int irqnuma_sysfs_string(char *path, char *buffer, int length)
+{
+     int fd, rt;
+     
+     if ((fd = open(path,O_RDONLY)) < 0) return -1;
+     rt = read(fd,buffer,length-1);
+     close(fd);
+     if (rt <= 0) return -1;
+     if (buffer[rt-1] == '\n') rt--; 
+     buffer[rt]='\0';
+     return rt;
+}
+
 // read a simple integer from a sysfs path
 int irqnuma_sysfs_integer(char *path)
 {
-     int fd, number;
-     
-     number = -1;
+     char buffer[32];
      
-     if ((fd = open(path,O_RDONLY)) >= 0) {
-	  char buffer[8];
-	  int rt;
-	  
-	  if ((rt = read(fd,buffer,8)) >= 0) {
-	       number = strtol(buffer,NULL,10);
-	  }
-     }
-     close(fd);
-     return number;
+     if (irqnuma_sysfs_string(path,buffer,sizeof(buffer)) < 0) return -1;
+     return strtol(buffer,NULL,10);
 }
      
 // read a bitmask. The format for the direct bitmaps varies between kernels. In some (2.6.32) a 
 // hex number is returned. In others (4.4.60) a direct representation of the bitmask is returned. 
-// So we parse the human readable form. 
+// So we parse the human readable form. The caller frees it with numa_bitmask_free
 struct bitmask *irqnuma_sysfs_cpustring(char *path)
 {
-     int fd; 
      char buffer[4096];
-     struct bitmask *b;
-     
-     b=NULL;
-     memset(buffer,0,4096);
      
-     if ((fd = open(path,O_RDONLY)) >= 0) {
-	  int rt;
-	  if ((rt = read(fd,buffer,4096)) >= 0) {
-	       buffer[rt-1]='\0'; // trim the '\n' off the end. 
-	       b = numa_parse_cpustring(buffer);
-	  }
-     }
-     close(fd);
-     return b;
+     if (irqnuma_sysfs_string(path,buffer,sizeof(buffer)) < 0) return NULL;
+     return numa_parse_cpustring(buffer);
 }
      
 int irqnuma_get_packageid(int cpuid)
@@ -102,6 +110,7 @@ int irqnuma_get_threadid(int cpuid)
      for (i=0;i<cpuid;i++) {
 	  if (numa_bitmask_isbitset(cpumask,i)) j++;
      }
+     numa_bitmask_free(cpumask);
      
      return j;
 }
@@ -144,7 +153,10 @@ int irqnuma_get_clocktick_ms()
 
 void irqnuma_init_topology()
 {
-     int i;
+     char *format = "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list";
+     char file[IRQ_PATH_MAX];
+     static int package_of[MAX_CPUS], core_of[MAX_CPUS], thread_of[MAX_CPUS];
+     int i,j,t;
 
      if (numa_available() == -1) { 
 	  fprintf(stderr,"numalib reports not available. Exiting\n");
@@ -162,19 +174,255 @@ void irqnuma_init_topology()
      
      // number of 'cpus'
      topology.number_of_cpus = numa_num_configured_cpus(); // includes disabled cpus. 
+     if (topology.number_of_cpus > MAX_CPUS) {
+	  fprintf(stderr,"bug: recompile with increased max cpus. current max_cpus = %d, numalib says you have %d\n",MAX_CPUS,topology.number_of_cpus);
+	  exit(-1);
+     }
 
      // duration of a jiffy / clock tick
      topology.clock_tick_ms = irqnuma_get_clocktick_ms();
      
-     // now we loop through the cpu list - which is hopefully contiguous 
-     // and build our topology map. 
+     // now we loop through the cpu list - which is hopefully contiguous - a physical core at a time. 
+     // The package and core ids are shared by the siblings, so they're read once for the first 
+     // sibling we meet and the thread id is the position in the siblings list. 
+     for (i=0; i<topology.number_of_cpus; i++) thread_of[i] = -1;
+     for (i=0; i<topology.number_of_cpus; i++) {
+	  struct bitmask *siblings;
+	  int package_id, core_id;
+	  
+	  if (thread_of[i] >= 0) continue; // done as a sibling of an earlier cpu 
+	  
+	  package_id = irqnuma_get_packageid(i); // could use numa_node_of_cpu ?? 
+	  core_id = irqnuma_get_coreid(i);
+	  sprintf(file,format,i);
+	  if ((siblings = irqnuma_sysfs_cpustring(file)) == NULL) {
+	       fprintf(stderr,"irqnuma: unable to read the thread siblings list for cpu %d\n",i);
+	       exit(-1);
+	  }
+	  t=0;
+	  for (j=0; j<topology.number_of_cpus; j++) {
+	       if (!numa_bitmask_isbitset(siblings,j)) continue;
+	       package_of[j] = package_id;
+	       core_of[j] = core_id;
+	       thread_of[j] = t++;
+	  }
+	  numa_bitmask_free(siblings);
+	  
+	  if (thread_of[i] < 0) { // not in its own siblings list. Shouldn't happen 
+	       package_of[i] = package_id;
+	       core_of[i] = core_id;
+	       thread_of[i] = 0;
+	  }
+     }
+     
+     // and build our topology map in cpu order 
      for (i=0; i<topology.number_of_cpus; i++) {
-	  // we need the socket physical package id, core id and cpu id and ht number 
-	  int package_id = irqnuma_get_packageid(i); // could use numa_node_of_cpu ?? 
-	  int core_id = irqnuma_get_coreid(i);
-	  int thread_id = irqnuma_get_threadid(i);
 	  // cpuid == i
-	  irqnuma_add_cpu_to_topology(i,package_id,core_id,thread_id);
+	  irqnuma_add_cpu_to_topology(i,package_of[i],core_of[i],thread_of[i]);
+     }
+     return;
+}
+
+// fill in the key for the topology cache. The boot id changes on every boot, and the online 
+// mask when cpus are hotplugged. Returns -1 if either can't be read. 
+static int irqnuma_topology_cache_key(struct topology_cache_header *h)
+{
+     memset((void *)h,0,sizeof(struct topology_cache_header));
+     h->magic = TOPOLOGY_CACHE_MAGIC;
+     h->version = TOPOLOGY_CACHE_VERSION;
+     h->size = sizeof(struct numa_topology);
+     if (irqnuma_sysfs_string(PROC_BOOT_ID,h->boot_id,sizeof(h->boot_id)) < 0) return -1;
+     if (irqnuma_sysfs_string(SYSFS_CPU_ONLINE,h->online,sizeof(h->online)) < 0) return -1;
+     return 0;
+}
+
+// everything the cached copy is indexed by, against the MAX_ sizes, so a damaged or foreign file can't
+// send the display or the exporters off the end of an array. The cpu count must add up too 
+static int irqnuma_topology_valid(struct numa_topology *t)
+{
+     int s,h,c,cpus = 0;
+     
+     if ((t->number_of_sockets <= 0) || (t->number_of_sockets > MAX_SOCKETS)) return 0;
+     if ((t->number_of_cpus <= 0) || (t->number_of_cpus > MAX_CPUS)) return 0;
+     for (s=0;s<t->number_of_sockets;s++) {
+	  if ((t->map[s].thread_count < 0) || (t->map[s].thread_count > MAX_THREADS)) return 0;
+	  for (h=0;h<t->map[s].thread_count;h++) {
+	       if ((t->map[s].threads[h].core_count < 0) || (t->map[s].threads[h].core_count > MAX_CORES)) return 0;
+	       for (c=0;c<t->map[s].threads[h].core_count;c++) {
+		    int cpu_id = t->map[s].threads[h].cores[c].cpu_id;
+		    
+		    if ((cpu_id < 0) || (cpu_id >= MAX_CPUS)) return 0;
+		    cpus++;
+	       }
+	  }
+     }
+     return (cpus == t->number_of_cpus);
+}
+
+// load the topology from the cache. Returns 0 if it was there, whole, sane, and for this boot and set
+// of cpus. Otherwise the caller rescans 
+int irqnuma_load_topology_cache(char *path)
+{
+     struct topology_cache_header key, cached;
+     struct numa_topology t;
+     char extra;
+     int fd, rt = -1;
+     
+     if (irqnuma_topology_cache_key(&key) < 0) return -1;
+     if ((fd = open(path,O_RDONLY)) < 0) return -1;
+     
+     if ((read(fd,&cached,sizeof(cached)) == sizeof(cached)) && 
+	 (memcmp(&key,&cached,sizeof(key)) == 0) && 
+	 (read(fd,&t,sizeof(t)) == sizeof(t)) &&
+	 (read(fd,&extra,1) == 0) &&
+	 (irqnuma_topology_valid(&t))) {
+	  memcpy(&topology,&t,sizeof(t));
+	  topology.clock_tick_ms = irqnuma_get_clocktick_ms();
+	  rt = 0;
+     }
+     close(fd);
+     return rt;
+}
+
+// write the topology out for the next run. This is best effort, so failure (not root, no /run) is silent. 
+// It goes to a temporary file first so a reader never sees half of one. 
+void irqnuma_save_topology_cache(char *path)
+{
+     struct topology_cache_header key;
+     char tmp[IRQ_PATH_MAX];
+     int fd, ok;
+     
+     if (irqnuma_topology_cache_key(&key) < 0) return;
+     snprintf(tmp,sizeof(tmp),"%s.%d",path,getpid());
+     if ((fd = open(tmp,O_WRONLY|O_CREAT|O_TRUNC,0644)) < 0) return;
+     
+     ok = (write(fd,&key,sizeof(key)) == sizeof(key)) && 
+	  (write(fd,&topology,sizeof(topology)) == sizeof(topology));
+     close(fd);
+     if (!ok || (rename(tmp,path) < 0)) unlink(tmp);
+     return;
+}
+
+// as irqnuma_init_topology, but try the cache at path first and refresh it if it was stale
+void irqnuma_init_topology_cached(char *path)
+{
+     if (irqnuma_load_topology_cache(path) == 0) return;
+     irqnuma_init_topology();
+     irqnuma_save_topology_cache(path);
+     return;
+}
+
+// the L3 (or CCX) domain of a cpu, named by the lowest cpu that shares it. Each shared_cpu_list 
+// is read once and the answer filled in for every cpu in it. leader_of starts as all -1. 
+// Returns -1 if there's no L3 in sysfs. 
+int irqnuma_get_l3_leader(int cpuid, int *leader_of)
+{
+     char *format = "/sys/devices/system/cpu/cpu%d/cache/index3/shared_cpu_list";
+     char file[IRQ_PATH_MAX];
+     struct bitmask *shared;
+     int i, leader = -1;
+     
+     if (leader_of[cpuid] >= 0) return leader_of[cpuid];
+     
+     sprintf(file,format,cpuid);
+     if ((shared = irqnuma_sysfs_cpustring(file)) == NULL) return -1;
+     for (i=0;i<topology.number_of_cpus;i++) {
+	  if (!numa_bitmask_isbitset(shared,i)) continue;
+	  if (leader < 0) leader = i;
+	  leader_of[i] = leader;
+     }
+     numa_bitmask_free(shared);
+     if (leader < 0) leader = leader_of[cpuid] = cpuid;
+     return leader;
+}
+
+// build the column layout for a fold mode. cpus are visited in the usual socket/thread/core 
+// order and each lands in the first column of its socket with the same key - the core id, 
+// L3 leader or numa node - so the columns come out in thread 0 order. 
+void irqnuma_build_fold(int mode, struct fold_layout *f)
+{
+     static int key_of_column[MAX_CPUS], leader_of[MAX_CPUS];
+     int s,t,c,i,k,key,first;
+     
+     memset((void *)f,0,sizeof(struct fold_layout));
+     f->mode = mode;
+     for (i=0;i<MAX_CPUS;i++) {
+	  f->column_of[i] = -1;
+	  leader_of[i] = -1;
+     }
+     
+     for (s=0;s<topology.number_of_sockets;s++) {
+	  first = f->column_count; // first column of this socket 
+	  for (t=0;t<topology.map[s].thread_count;t++) {
+	       for (c=0;c<topology.map[s].threads[t].core_count;c++) {
+		    int cpuid = topology.map[s].threads[t].cores[c].cpu_id;
+		    
+		    switch (mode) {
+		    case FOLD_CORE:
+			 key = topology.map[s].threads[t].cores[c].core_id;
+			 break;
+		    case FOLD_L3:
+			 key = irqnuma_get_l3_leader(cpuid,leader_of); // -1, no L3, is the whole socket 
+			 break;
+		    case FOLD_NODE:
+			 key = numa_node_of_cpu(cpuid);
+			 break;
+		    default:
+			 key = cpuid;
+		    }
+		    
+		    for (k=first;k<f->column_count;k++) if (key_of_column[k] == key) break;
+		    if ((mode == FOLD_NONE) || (k == f->column_count)) {
+			 k = f->column_count++;
+			 key_of_column[k] = key;
+			 f->columns[k].socket = s;
+			 f->columns[k].thread = (mode == FOLD_NONE) ? t : -1;
+			 f->columns[k].leader = cpuid;
+			 if (k == 0) f->columns[k].separator = '\0';
+			 else if (k == first) f->columns[k].separator = ' ';
+			 else if ((mode == FOLD_NONE) && (c == 0)) f->columns[k].separator = '|';
+			 else f->columns[k].separator = '\0';
+			 if (f->columns[k].separator) f->width++;
+			 f->width++;
+		    }
+		    if (cpuid < f->columns[k].leader) f->columns[k].leader = cpuid;
+		    f->columns[k].cpu_count++;
+		    f->column_of[cpuid] = k;
+	       }
+	  }
+     }
+     return;
+}
+
+// as irqnuma_build_fold, for a machine we only know the socket of each cpu for - a recording from 
+// another host. FOLD_NONE is a column per cpu grouped by socket, any other fold a column per socket. 
+void irqnuma_build_fold_sockets(int mode, int *socket_of, int cpu_count, struct fold_layout *f)
+{
+     int s,c,k,max_socket = 0;
+     
+     memset((void *)f,0,sizeof(struct fold_layout));
+     f->mode = (mode == FOLD_NONE) ? FOLD_NONE : FOLD_NODE;
+     for (c=0;c<MAX_CPUS;c++) f->column_of[c] = -1;
+     for (c=0;c<cpu_count;c++) max_socket = (socket_of[c] > max_socket) ? socket_of[c] : max_socket;
+     
+     for (s=0;s<=max_socket;s++) {
+	  int first = f->column_count;
+	  
+	  for (c=0;c<cpu_count;c++) {
+	       if (socket_of[c] != s) continue;
+	       if ((f->mode == FOLD_NONE) || (f->column_count == first)) {
+		    k = f->column_count++;
+		    f->columns[k].socket = s;
+		    f->columns[k].thread = -1;
+		    f->columns[k].leader = c;
+		    f->columns[k].separator = ((k == first) && (k > 0)) ? ' ' : '\0';
+		    if (f->columns[k].separator) f->width++;
+		    f->width++;
+	       }
+	       k = f->column_count-1;
+	       f->columns[k].cpu_count++;
+	       f->column_of[c] = k;
+	  }
      }
      return;
 }
@@ -4,6 +4,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 // numalib does not understand hyperthreads, so we extend it here. 
@@ -14,6 +15,10 @@
 #define MAX_SOCKETS 4
 #define MAX_THREADS 4
 #define MAX_CORES 64
+#define MAX_CPUS (MAX_SOCKETS*MAX_THREADS*MAX_CORES)  
+
+// where -c keeps the topology between runs. Only valid for the boot and online cpus it was built with
+#define TOPOLOGY_CACHE_PATH "/run/irq_heatmap.topology"
  
 struct core_desc_struct {
      int configured; 
@@ -42,8 +47,34 @@ struct numa_topology {
 
 extern struct numa_topology topology;
 
+// how the cpus are laid out across the screen. FOLD_NONE is a column per cpu in socket/thread/core 
+// order, the others merge cpus into one column per physical core, L3 cache domain or numa node. 
+// The tables are built once so the display only has to look up column_of[cpu]. 
+#define FOLD_NONE 0
+#define FOLD_CORE 1
+#define FOLD_L3   2
+#define FOLD_NODE 3
+#define FOLD_COUNT 4
+
+struct fold_column {
+     int socket;
+     int thread;     // FOLD_NONE only, -1 otherwise 
+     int leader;     // lowest cpu id in the column, for the header 
+     int cpu_count;
+     char separator; // printed before the column, '\0' for none 
+};
+
+struct fold_layout {
+     int mode;
+     int column_count;
+     int width;      // characters, including the separators 
+     int column_of[MAX_CPUS];
+     struct fold_column columns[MAX_CPUS];
+};
+
 /* irq_numa.c */
 int irqnuma_num_hyperthreads(void);
+int irqnuma_sysfs_string(char *path, char *buffer, int length);
 int irqnuma_sysfs_integer(char *path);
 struct bitmask *irqnuma_sysfs_cpustring(char *path);
 int irqnuma_get_packageid(int cpuid);
@@ -52,4 +83,10 @@ int irqnuma_get_threadid(int cpuid);
 void irqnuma_add_cpu_to_topology(int cpuid, int socket, int coreid, int thread_id);
 int irqnuma_get_clocktick_ms(void);
 void irqnuma_init_topology(void);
+int irqnuma_load_topology_cache(char *path);
+void irqnuma_save_topology_cache(char *path);
+void irqnuma_init_topology_cached(char *path);
 void irqnuma_dump_topology(void);
+int irqnuma_get_l3_leader(int cpuid, int *leader_of);
+void irqnuma_build_fold(int mode, struct fold_layout *f);
+void irqnuma_build_fold_sockets(int mode, int *socket_of, int cpu_count, struct fold_layout *f);
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "irq_scale.h"
+
+// 16, 32 or 64 levels. scale_shift is log2 of the steps per octave on the log scale
+int scale_levels = 16;
+int scale_shift = 0;
+
+// the color for each level, interpolated from one of the 16 entry palettes
+char *scale_ramp[MAX_LEVELS];
+static char ramp_text[MAX_LEVELS][12];
+
+// what's printed for each level. The first 16 are the original hex digits
+char scale_glyphs[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ@#";
+
+// the first 16 xterm colors are set by the terminal, these are the usual defaults
+static const unsigned char system_rgb[16][3] = {
+     {0,0,0},{128,0,0},{0,128,0},{128,128,0},{0,0,128},{128,0,128},{0,128,128},{192,192,192},
+     {128,128,128},{255,0,0},{0,255,0},{255,255,0},{0,0,255},{255,0,255},{0,255,255},{255,255,255}
+};
+static const unsigned char cube_steps[6] = {0,95,135,175,215,255};
+
+// the fine log level of d. 0 for 0, otherwise the number of bits in d, split into 1<<shift steps by
+// the bits just below the leading one. With shift 0 this is the original one level per power of 2.
+// Written with clz and conditional moves so there are no loops or branches per cell
+static inline unsigned int fine_level(unsigned long int d, int shift)
+{
+     unsigned int bits = d ? 64 - __builtin_clzl(d) : 0;
+     unsigned long int frac = (bits > shift) ? (d >> (bits-1-shift)) : (d << (shift+1-bits));
+
+     return bits ? ((bits-1) << shift) + (frac & ((1<<shift)-1)) + 1 : 0;
+}
+
+int irqscale_set_levels(int levels)
+{
+     switch (levels) {
+     case 16: scale_shift = 0; break;
+     case 32: scale_shift = 1; break;
+     case 64: scale_shift = 2; break;
+     default: return -1;
+     }
+     scale_levels = levels;
+     return 0;
+}
+
+// log|lin|pct[:floor[:ceiling]] e.g. log:1000:100000 or pct. Returns -1 if it doesn't parse
+int irqscale_parse(struct scale_struct *sc, char *spec)
+{
+     char *endptr;
+
+     if (strncmp(spec,"log",3) == 0) sc->type = SCALE_LOG;
+     else if (strncmp(spec,"lin",3) == 0) sc->type = SCALE_LINEAR;
+     else if (strncmp(spec,"pct",3) == 0) sc->type = SCALE_PERCENTILE;
+     else return -1;
+
+     if ((spec = strchr(spec,':')) == NULL) return 0;
+     sc->floor = strtoul(spec+1,&endptr,10);
+     if (*endptr == '\0') return 0;
+     if (*endptr != ':') return -1;
+     sc->ceiling = strtoul(endptr+1,&endptr,10);
+     if (*endptr != '\0') return -1;
+     if ((sc->ceiling) && (sc->ceiling <= sc->floor)) return -1;
+     return 0;
+}
+
+static void xterm_to_rgb(int index, int *rgb)
+{
+     int i;
+
+     if (index < 16) {
+	  for (i=0;i<3;i++) rgb[i] = system_rgb[index][i];
+     } else if (index < 232) {
+	  index -= 16;
+	  rgb[0] = cube_steps[index/36];
+	  rgb[1] = cube_steps[(index/6)%6];
+	  rgb[2] = cube_steps[index%6];
+     } else {
+	  rgb[0] = rgb[1] = rgb[2] = 8 + 10*(index-232);
+     }
+     return;
+}
+
+// nearest of the 6x6x6 cube and grey ramp. The system colors are skipped as they vary
+static int rgb_to_xterm(int *rgb)
+{
+     int i, c, best = 16, best_distance = -1, cube = 0;
+
+     for (i=0;i<3;i++) {
+	  int j = 0;
+
+	  for (c=1;c<6;c++) if (abs(cube_steps[c]-rgb[i]) < abs(cube_steps[j]-rgb[i])) j = c;
+	  cube = cube*6 + j;
+     }
+     for (c=0;c<25;c++) {
+	  int candidate = (c == 24) ? 16+cube : 232+c;
+	  int crgb[3], distance = 0;
+
+	  xterm_to_rgb(candidate,crgb);
+	  for (i=0;i<3;i++) distance += (crgb[i]-rgb[i])*(crgb[i]-rgb[i]);
+	  if ((best_distance < 0) || (distance < best_distance)) {
+	       best = candidate;
+	       best_distance = distance;
+	  }
+     }
+     return best;
+}
+
+// stretch a palette over scale_levels by interpolating in rgb between its entries. Levels that
+// land exactly on a palette entry use it as is, so 16 levels is the palette unchanged.
+void irqscale_build_ramp(char **palette, int palette_size)
+{
+     int j;
+
+     for (j=0;j<scale_levels;j++) {
+	  int position = j*(palette_size-1)*256/(scale_levels-1); // 8 bits of fraction
+	  int i = position >> 8, t = position & 255;
+	  int low[3], high[3], rgb[3], k;
+
+	  if (t == 0) {
+	       scale_ramp[j] = palette[i];
+	       continue;
+	  }
+	  xterm_to_rgb(atoi(palette[i]),low);
+	  xterm_to_rgb(atoi(palette[i+1]),high);
+	  for (k=0;k<3;k++) rgb[k] = (low[k]*(256-t) + high[k]*t) >> 8;
+	  snprintf(ramp_text[j],sizeof(ramp_text[j]),"%d",rgb_to_xterm(rgb));
+	  scale_ramp[j] = ramp_text[j];
+     }
+     return;
+}
+
+static void quantize_log(struct scale_struct *sc, unsigned long int *value, unsigned int *level, int n)
+{
+     int i, offset = 0, top = scale_levels-1;
+
+     // a ceiling puts itself on the top level, a floor on the bottom
+     if (sc->ceiling) offset = fine_level(sc->ceiling,scale_shift) - top;
+     else if (sc->floor) offset = fine_level(sc->floor,scale_shift);
+     if (offset < 0) offset = 0;
+
+     for (i=0;i<n;i++) {
+	  int l = (int)fine_level(value[i],scale_shift) - offset;
+
+	  l = (l < 0) ? 0 : l;
+	  l = (l > top) ? top : l;
+	  level[i] = (value[i] <= sc->floor) ? 0 : l;
+     }
+     return;
+}
+
+static void quantize_linear(struct scale_struct *sc, unsigned long int *value, unsigned int *level, int n)
+{
+     int i, shift = 0, top = scale_levels-1;
+     unsigned long int ceiling = sc->ceiling, span;
+
+     if (ceiling == 0) for (i=0;i<n;i++) ceiling = (value[i] > ceiling) ? value[i] : ceiling;
+     if (ceiling <= sc->floor) ceiling = sc->floor+1;
+     span = ceiling - sc->floor;
+     while (span > (~0UL)/MAX_LEVELS) { // keep v*top from overflowing
+	  span >>= 1;
+	  shift++;
+     }
+
+     for (i=0;i<n;i++) {
+	  unsigned long int v = value[i];
+
+	  v = (v > ceiling) ? ceiling : v;
+	  v = (v > sc->floor) ? (v - sc->floor) >> shift : 0;
+	  level[i] = (v*top + span - 1)/span; // round up, so anything over the floor shows
+     }
+     return;
+}
+
+static void quantize_percentile(struct scale_struct *sc, unsigned long int *value, unsigned int *level, int n)
+{
+     int i, b, top = scale_levels-1;
+     unsigned long int below = 0;
+
+     // learn from this row. Old samples fade by halving, so the scale follows the load
+     if (sc->total >= SCALE_HISTORY_MAX) {
+	  sc->total = 0;
+	  for (b=0;b<SCALE_BINS;b++) {
+	       sc->history[b] >>= 1;
+	       sc->total += sc->history[b];
+	  }
+     }
+     for (i=0;i<n;i++) {
+	  if (value[i] == 0) continue;
+	  sc->history[fine_level(value[i],2)]++;
+	  sc->total++;
+     }
+
+     // non zero values share levels 1..top by where the middle of their bin sits in the distribution
+     sc->lut[0] = 0;
+     for (b=1;b<SCALE_BINS;b++) {
+	  unsigned long int middle = below + sc->history[b]/2;
+
+	  sc->lut[b] = (sc->total) ? 1 + (middle*(top-1))/sc->total : 1;
+	  below += sc->history[b];
+     }
+
+     for (i=0;i<n;i++) {
+	  unsigned int l = sc->lut[fine_level(value[i],2)];
+
+	  l = (sc->ceiling && (value[i] >= sc->ceiling)) ? top : l;
+	  level[i] = (value[i] <= sc->floor) ? 0 : l;
+     }
+     return;
+}
+
+// quantize a whole row of values into levels 0..scale_levels-1
+void irqscale_quantize_row(struct scale_struct *sc, unsigned long int *value, unsigned int *level, int n)
+{
+     switch (sc->type) {
+     case SCALE_LINEAR:
+	  quantize_linear(sc,value,level,n);
+	  break;
+     case SCALE_PERCENTILE:
+	  quantize_percentile(sc,value,level,n);
+	  break;
+     default:
+	  quantize_log(sc,value,level,n);
+     }
+     return;
+}
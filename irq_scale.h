@@ -0,0 +1,36 @@
+#include <string.h>
+
+// turning deltas into color levels.
+//
+// log is the original scale, a level per power of two, optionally split into 2 or 4 steps per octave.
+// linear runs from floor to ceiling (or the biggest value in the row if there's no ceiling).
+// percentile learns the distribution of the values it's been shown and spreads the levels evenly over it.
+#define SCALE_LOG 0
+#define SCALE_LINEAR 1
+#define SCALE_PERCENTILE 2
+
+#define MAX_LEVELS 64
+
+// percentile keeps a histogram at quarter octave resolution, one bin per fine level
+#define SCALE_BINS (64*4+1)
+#define SCALE_HISTORY_MAX (1<<16) // samples before the history is halved
+
+struct scale_struct {
+     int type;
+     unsigned long int floor;   // at or below this is level 0
+     unsigned long int ceiling; // at or above this is the top level. 0 for none
+     unsigned long int total;
+     unsigned int history[SCALE_BINS];
+     unsigned char lut[SCALE_BINS]; // bin to level, rebuilt each row
+};
+
+extern int scale_levels;
+extern int scale_shift;
+extern char *scale_ramp[MAX_LEVELS];
+extern char scale_glyphs[];
+
+/* irq_scale.c */
+int irqscale_set_levels(int levels);
+int irqscale_parse(struct scale_struct *sc, char *spec);
+void irqscale_build_ramp(char **palette, int palette_size);
+void irqscale_quantize_row(struct scale_struct *sc, unsigned long int *value, unsigned int *level, int n);
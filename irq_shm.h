@@ -0,0 +1,136 @@
+#ifndef IRQ_SHM_H
+#define IRQ_SHM_H
+
+// Layout of the shared memory segment written by irq_heatmap -o shm:<name>, and helpers for readers.
+// This header stands alone so other programs can include it. See irq_shm_reader.c for an example.
+//
+// The segment, /dev/shm/<name>, is
+//
+//   struct irq_shm_header                      at 0
+//   struct irq_shm_label  labels[series_count] at label_offset
+//   slot 0 .. slot ring_size-1                 at ring_offset, slot_size bytes apart
+//
+// and a slot is struct irq_shm_slot followed by series_count*cpu_count uint64_t deltas, series major:
+// the delta for series s on cpu c is delta[s*cpu_count + c]. Offsets are from the start of the segment.
+//
+// Interval n (counting from 1) is written to slot n % ring_size, so the last ring_size intervals are
+// there to be read. Each slot has its own seqlock: the writer makes sequence odd, writes the slot, then
+// makes it even again. A reader copies what it wants between two reads of sequence and keeps the copy if
+// they're equal and even. Once the slot is written the header's latest is set to n. Nothing takes a lock
+// or makes a syscall, so any number of readers can poll it.
+//
+// The layout is fixed for the life of the writer. A new writer (different metrics, say) unlinks and
+// recreates the segment, so readers that see the writer go away should map it again. The writer sets
+// heartbeat (CLOCK_MONOTONIC ns) each interval and to 0 when it exits, when it also unlinks the segment.
+// irq_shm_alive tells from those whether anyone is still writing, again without a syscall.
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define IRQ_SHM_MAGIC 0x69727173 // 'irqs', set last so a half built header isn't mistaken for one
+#define IRQ_SHM_VERSION 1
+#define IRQ_SHM_RING 16
+#define IRQ_SHM_LABEL 72
+
+struct irq_shm_header {
+     uint32_t magic;
+     uint32_t version;
+     uint32_t series_count;
+     uint32_t cpu_count;
+     uint32_t ring_size;
+     uint32_t slot_size;     // bytes, a multiple of 64
+     uint64_t label_offset;
+     uint64_t ring_offset;
+     uint64_t size;          // of the whole segment
+     uint64_t latest;        // last complete interval, 0 before the first
+     int32_t  writer_pid;
+     uint32_t interval;      // seconds between samples
+     int64_t  heartbeat;     // CLOCK_MONOTONIC ns of the last write, 0 once the writer has exited
+};
+
+struct irq_shm_label {
+     char text[IRQ_SHM_LABEL]; // the metric's label, e.g. "NET_RX" or "cpu sys"
+};
+
+struct irq_shm_slot {
+     uint64_t sequence;      // odd while being written
+     uint64_t number;        // the interval held
+     int64_t  time;          // seconds since the epoch
+     uint64_t pad;
+     uint64_t delta[];
+};
+
+static inline struct irq_shm_label *irq_shm_labels(struct irq_shm_header *h)
+{
+     return (struct irq_shm_label *)((char *)h + h->label_offset);
+}
+
+static inline struct irq_shm_slot *irq_shm_slot(struct irq_shm_header *h, uint64_t number)
+{
+     return (struct irq_shm_slot *)((char *)h + h->ring_offset + (number % h->ring_size)*h->slot_size);
+}
+
+// map a segment read only. NULL if it isn't there or isn't one of ours. Unmap with munmap(h, h->size)
+static inline struct irq_shm_header *irq_shm_attach(const char *name)
+{
+     struct irq_shm_header *h;
+     struct stat st;
+     int fd;
+
+     if ((fd = shm_open(name,O_RDONLY,0)) < 0) return NULL;
+     if ((fstat(fd,&st) < 0) || (st.st_size < (off_t)sizeof(struct irq_shm_header))) {
+	  close(fd);
+	  return NULL;
+     }
+     h = (struct irq_shm_header *)mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+     close(fd);
+     if (h == MAP_FAILED) return NULL;
+     if ((__atomic_load_n(&h->magic,__ATOMIC_ACQUIRE) != IRQ_SHM_MAGIC) || (h->version != IRQ_SHM_VERSION) ||
+	 (h->size != (uint64_t)st.st_size)) {
+	  munmap(h,st.st_size);
+	  return NULL;
+     }
+     return h;
+}
+
+static inline uint64_t irq_shm_latest(struct irq_shm_header *h)
+{
+     return __atomic_load_n(&h->latest,__ATOMIC_ACQUIRE);
+}
+
+// 0 once the writer has exited, or missed three intervals (killed, or stopped in a debugger)
+static inline int irq_shm_alive(struct irq_shm_header *h)
+{
+     int64_t heartbeat = __atomic_load_n(&h->heartbeat,__ATOMIC_ACQUIRE);
+     struct timespec now;
+
+     if (heartbeat == 0) return 0;
+     clock_gettime(CLOCK_MONOTONIC,&now); // the vdso, not a syscall
+     return ((int64_t)now.tv_sec*1000000000 + now.tv_nsec - heartbeat) < ((int64_t)3*h->interval + 1)*1000000000;
+}
+
+// copy interval number's deltas (series_count*cpu_count of them) into delta and its time into *time.
+// Returns 0, or -1 if that interval has been overwritten or isn't written yet.
+static inline int irq_shm_read(struct irq_shm_header *h, uint64_t number, uint64_t *delta, int64_t *time)
+{
+     struct irq_shm_slot *slot = irq_shm_slot(h,number);
+     uint64_t before, after;
+
+     do {
+	  before = __atomic_load_n(&slot->sequence,__ATOMIC_ACQUIRE);
+	  if (before & 1) continue; // being written, try again
+	  if (__atomic_load_n(&slot->number,__ATOMIC_RELAXED) != number) return -1;
+	  memcpy(delta,slot->delta,sizeof(uint64_t)*h->series_count*h->cpu_count);
+	  *time = slot->time;
+	  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+	  after = __atomic_load_n(&slot->sequence,__ATOMIC_RELAXED);
+     } while ((before & 1) || (before != after));
+     return 0;
+}
+
+#endif
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "irq_shm.h"
+
+// An example reader for irq_heatmap -o shm:<name>. It follows the segment and prints, for each new
+// interval, the total of each metric across the cpus and the busiest cpu. Build with 'make irq_shm_reader'.
+//
+// usage: irq_shm_reader [name]   e.g. irq_heatmap -D -S NET_RX -M p5p1 -o shm:irq_heatmap ; irq_shm_reader irq_heatmap
+
+int main(int argc, char *argv[])
+{
+     char *name = (argc > 1) ? argv[1] : "irq_heatmap";
+     char path[256];
+     struct irq_shm_header *h;
+     struct irq_shm_label *labels;
+     uint64_t *delta, seen, number;
+     int64_t time;
+     int s,c;
+
+     snprintf(path,sizeof(path),"%s%s",(name[0] == '/') ? "" : "/",name);
+     if ((h = irq_shm_attach(path)) == NULL) {
+	  fprintf(stderr,"no irq_heatmap segment called %s\n",path);
+	  exit(-1);
+     }
+     labels = irq_shm_labels(h);
+     if ((delta = malloc(sizeof(uint64_t)*h->series_count*h->cpu_count)) == NULL) exit(-1);
+
+     printf("%s: %u metrics, %u cpus, every %us, from pid %d\n",path,h->series_count,h->cpu_count,h->interval,h->writer_pid);
+     seen = irq_shm_latest(h);
+     for (;;) {
+	  // a new writer makes a new segment, so stop if this one has gone
+	  if (!irq_shm_alive(h)) {
+	       fprintf(stderr,"writer %d has gone\n",h->writer_pid);
+	       break;
+	  }
+	  number = irq_shm_latest(h);
+	  // if we fell more than a ring behind, the oldest are gone. Start from what's still there
+	  if (number - seen > h->ring_size) seen = number - h->ring_size;
+	  for (seen++;seen<=number;seen++) {
+	       if (irq_shm_read(h,seen,delta,&time) < 0) continue;
+	       for (s=0;s<h->series_count;s++) {
+		    uint64_t *d = &delta[s*h->cpu_count], total = 0;
+		    int busiest = 0;
+
+		    for (c=0;c<h->cpu_count;c++) {
+			 total += d[c];
+			 if (d[c] > d[busiest]) busiest = c;
+		    }
+		    printf("%lld %lu %s: total %lu, busiest cpu %d with %lu\n",(long long)time,(unsigned long)seen,
+			   labels[s].text,(unsigned long)total,busiest,(unsigned long)d[busiest]);
+	       }
+	  }
+	  seen = number;
+	  fflush(stdout);
+	  usleep(100000); // no syscalls are needed to read, this is only so we don't spin
+     }
+     munmap(h,h->size);
+     free(delta);
+     return 0;
+}